@@ -0,0 +1,144 @@
+// Copy kernels used to fill hugepage target from a small cache resident buffer.
+// Streaming (non-temporal) stores skip cache and read-for-ownership of destination,
+// so filling hundreds of GB doesn't evict everything else running on the host.
+// Shared by hugecp.cpp and hugecp_bench.cpp, selected at runtime by cpu support,
+// together with the size option parser both use.
+#ifndef HUGECP_COPY_KERNEL_H
+#define HUGECP_COPY_KERNEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+enum CopyKernel {
+    COPY_DIRECT,  // no user space copy, read lands straight in target
+    COPY_MEMCPY,  // plain memcpy from bounce buffer
+    COPY_SSE2,
+    COPY_AVX2,
+    COPY_AVX512,
+    COPY_KERNEL_COUNT
+};
+
+static const char *copyKernelNames[COPY_KERNEL_COUNT] = {"direct", "memcpy", "sse2", "avx2", "avx512"};
+
+typedef void (*CopyFunc)(char *dst, const char *src, size_t len);
+
+static inline void copyMemcpy(char *dst, const char *src, size_t len) {
+    memcpy(dst, src, len);
+}
+
+static inline void copyStreamSse2(char *dst, const char *src, size_t len) {
+    while (len > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = *src++;
+        len--;
+    }
+    for (; len >= 64; len -= 64, src += 64, dst += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static inline void copyStreamAvx2(char *dst, const char *src, size_t len) {
+    while (len > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = *src++;
+        len--;
+    }
+    for (; len >= 128; len -= 128, src += 128, dst += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)src);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)dst, a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + 96), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+
+__attribute__((target("avx512f")))
+static inline void copyStreamAvx512(char *dst, const char *src, size_t len) {
+    while (len > 0 && ((uintptr_t)dst & 63)) {
+        *dst++ = *src++;
+        len--;
+    }
+    for (; len >= 256; len -= 256, src += 256, dst += 256) {
+        __m512i a = _mm512_loadu_si512((const void *)src);
+        __m512i b = _mm512_loadu_si512((const void *)(src + 64));
+        __m512i c = _mm512_loadu_si512((const void *)(src + 128));
+        __m512i d = _mm512_loadu_si512((const void *)(src + 192));
+        _mm512_stream_si512((__m512i *)dst, a);
+        _mm512_stream_si512((__m512i *)(dst + 64), b);
+        _mm512_stream_si512((__m512i *)(dst + 128), c);
+        _mm512_stream_si512((__m512i *)(dst + 192), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+
+static inline bool copyKernelSupported(CopyKernel kernel) {
+    switch (kernel) {
+        case COPY_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case COPY_AVX512:
+            return __builtin_cpu_supports("avx512f");
+        default:
+            return kernel < COPY_KERNEL_COUNT;
+    }
+}
+
+// widest streaming kernel this cpu has
+static inline CopyKernel bestCopyKernel() {
+    if (copyKernelSupported(COPY_AVX512)) return COPY_AVX512;
+    if (copyKernelSupported(COPY_AVX2)) return COPY_AVX2;
+    return COPY_SSE2;
+}
+
+// parse kernel name, "auto" means best streaming kernel, COPY_KERNEL_COUNT if unknown
+static inline CopyKernel parseCopyKernel(const char *name) {
+    if (strcmp(name, "auto") == 0) return bestCopyKernel();
+    for (int i = 0; i < COPY_KERNEL_COUNT; i++) {
+        if (strcmp(name, copyKernelNames[i]) == 0) return (CopyKernel)i;
+    }
+    return COPY_KERNEL_COUNT;
+}
+
+static inline CopyFunc copyKernelFunc(CopyKernel kernel) {
+    switch (kernel) {
+        case COPY_SSE2:
+            return copyStreamSse2;
+        case COPY_AVX2:
+            return copyStreamAvx2;
+        case COPY_AVX512:
+            return copyStreamAvx512;
+        default:
+            return copyMemcpy;
+    }
+}
+
+// 4096, 2M, 1G style sizes, -1 when invalid
+static inline int64_t parseSize(const char *str) {
+    char *end;
+    double value = strtod(str, &end);
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; break;
+        case 'm': case 'M': value *= 1024 * 1024; break;
+        case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+        case '\0': break;
+        default: return -1;
+    }
+    return value > 0 ? (int64_t)value : -1;
+}
+
+#endif
@@ -0,0 +1,247 @@
+// FP8 E4M3 to BF16 dequantization kernels used by q8_bf16.cpp.
+// A kernel converts one contiguous run of a row which shares a single block
+// scale, so the caller walks blocks without any per element bounds check.
+// Selected at runtime by cpu support, the widest one runs at memory bandwidth.
+#ifndef Q8_DEQUANT_KERNEL_H
+#define Q8_DEQUANT_KERNEL_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+typedef uint16_t bfloat16;
+
+enum DequantKernel {
+  DEQUANT_SCALAR,      // 256 entry lookup table
+  DEQUANT_AVX2,        // bit manipulation decode, integer RNE rounding
+  DEQUANT_AVX512,      // same with 16 lanes
+  DEQUANT_AVX512_BF16, // rounding by VCVTNEPS2BF16
+  DEQUANT_KERNEL_COUNT
+};
+
+static const char *dequant_kernel_names[DEQUANT_KERNEL_COUNT] = {
+    "scalar", "avx2", "avx512", "avx512bf16"};
+
+typedef void (*DequantFunc)(const uint8_t *src, bfloat16 *dst, size_t len,
+                            float scale);
+
+// E4M3 (fn variant): 1 sign, 4 exponent bits with bias 7, 3 mantissa bits,
+// no infinities, S.1111.111 is NaN, exponent 0 is subnormal m * 2^-9
+inline float e4m3_to_float(uint8_t v) {
+  int exponent = (v >> 3) & 0xf, mantissa = v & 0x7;
+  float magnitude;
+  if (exponent == 0xf && mantissa == 0x7) {
+    magnitude = NAN;
+  } else if (exponent == 0) {
+    magnitude = std::ldexp((float)mantissa, -9);
+  } else {
+    magnitude = std::ldexp((float)(8 + mantissa), exponent - 10);
+  }
+  return v & 0x80 ? -magnitude : magnitude;
+}
+
+struct E4M3Table {
+  float value[256];
+  E4M3Table() {
+    for (int i = 0; i < 256; i++) {
+      value[i] = e4m3_to_float(i);
+    }
+  }
+};
+
+static const E4M3Table e4m3_table;
+
+// round to nearest even, NaN stays a quiet NaN instead of rounding into inf
+inline bfloat16 float_to_bfloat16(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return (bits >> 16) | 0x40;
+  }
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+inline float bfloat16_to_float(bfloat16 bf) {
+  uint32_t bits = (uint32_t)bf << 16;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline void dequant_scalar(const uint8_t *src, bfloat16 *dst, size_t len,
+                           float scale) {
+  for (size_t i = 0; i < len; i++) {
+    dst[i] = float_to_bfloat16(e4m3_table.value[src[i]] * scale);
+  }
+}
+
+// Vector decode: magnitude bits moved under float exponent and rebiased
+// (127 - 7 = 120) give every normal value exactly, subnormals are converted
+// from their mantissa and NaN is patched in. No gather and no denormal math.
+__attribute__((target("avx2"))) inline __m256 e4m3_decode_avx2(__m128i bytes) {
+  __m256i v = _mm256_cvtepu8_epi32(bytes);
+  __m256i magnitude = _mm256_and_si256(v, _mm256_set1_epi32(0x7f));
+  __m256i sign =
+      _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0x80)), 24);
+  __m256i rebiased = _mm256_add_epi32(_mm256_slli_epi32(magnitude, 20),
+                                      _mm256_set1_epi32(120 << 23));
+  __m256 subnormal = _mm256_mul_ps(_mm256_cvtepi32_ps(magnitude),
+                                   _mm256_set1_ps(1.0f / 512));
+  __m256i is_subnormal = _mm256_cmpgt_epi32(_mm256_set1_epi32(8), magnitude);
+  __m256i is_nan = _mm256_cmpeq_epi32(magnitude, _mm256_set1_epi32(0x7f));
+  __m256 value = _mm256_blendv_ps(_mm256_castsi256_ps(rebiased), subnormal,
+                                  _mm256_castsi256_ps(is_subnormal));
+  value = _mm256_blendv_ps(value, _mm256_set1_ps(NAN),
+                           _mm256_castsi256_ps(is_nan));
+  return _mm256_or_ps(value, _mm256_castsi256_ps(sign));
+}
+
+__attribute__((target("avx2"))) inline __m256i
+float_to_bfloat16_avx2(__m256 value) {
+  __m256i bits = _mm256_castps_si256(value);
+  __m256i high = _mm256_srli_epi32(bits, 16);
+  __m256i bias = _mm256_add_epi32(
+      _mm256_and_si256(high, _mm256_set1_epi32(1)), _mm256_set1_epi32(0x7fff));
+  __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, bias), 16);
+  // NaN is not rounded, it could carry into inf
+  __m256i quiet = _mm256_or_si256(high, _mm256_set1_epi32(0x40));
+  __m256 is_nan = _mm256_cmp_ps(value, value, _CMP_UNORD_Q);
+  return _mm256_blendv_epi8(rounded, quiet, _mm256_castps_si256(is_nan));
+}
+
+__attribute__((target("avx2"))) inline void
+dequant_avx2(const uint8_t *src, bfloat16 *dst, size_t len, float scale) {
+  __m256 factor = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+    __m256 lo = _mm256_mul_ps(e4m3_decode_avx2(bytes), factor);
+    __m256 hi =
+        _mm256_mul_ps(e4m3_decode_avx2(_mm_srli_si128(bytes, 8)), factor);
+    // pack works per 128 bit lane, permute puts the 16 results back in order
+    __m256i packed = _mm256_packus_epi32(float_to_bfloat16_avx2(lo),
+                                         float_to_bfloat16_avx2(hi));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  dequant_scalar(src + i, dst + i, len - i, scale);
+}
+
+// GCC 12 warns about the _mm512_undefined_* inside its own intrinsic headers,
+// a known false positive
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f"))) inline __m512
+e4m3_decode_avx512(__m128i bytes) {
+  __m512i v = _mm512_cvtepu8_epi32(bytes);
+  __m512i magnitude = _mm512_and_si512(v, _mm512_set1_epi32(0x7f));
+  __m512i sign =
+      _mm512_slli_epi32(_mm512_and_si512(v, _mm512_set1_epi32(0x80)), 24);
+  __m512i rebiased = _mm512_add_epi32(_mm512_slli_epi32(magnitude, 20),
+                                      _mm512_set1_epi32(120 << 23));
+  __m512 subnormal = _mm512_mul_ps(_mm512_cvtepi32_ps(magnitude),
+                                   _mm512_set1_ps(1.0f / 512));
+  __mmask16 is_subnormal =
+      _mm512_cmplt_epi32_mask(magnitude, _mm512_set1_epi32(8));
+  __mmask16 is_nan =
+      _mm512_cmpeq_epi32_mask(magnitude, _mm512_set1_epi32(0x7f));
+  __m512i value = _mm512_castps_si512(_mm512_mask_blend_ps(
+      is_subnormal, _mm512_castsi512_ps(rebiased), subnormal));
+  value = _mm512_mask_mov_epi32(value, is_nan, _mm512_set1_epi32(0x7fc00000));
+  return _mm512_castsi512_ps(_mm512_or_si512(value, sign));
+}
+
+__attribute__((target("avx512f"))) inline void
+dequant_avx512(const uint8_t *src, bfloat16 *dst, size_t len, float scale) {
+  __m512 factor = _mm512_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+    __m512 value = _mm512_mul_ps(e4m3_decode_avx512(bytes), factor);
+    __m512i bits = _mm512_castps_si512(value);
+    __m512i high = _mm512_srli_epi32(bits, 16);
+    __m512i lsb = _mm512_and_si512(high, _mm512_set1_epi32(1));
+    __m512i bias = _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff));
+    __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(bits, bias), 16);
+    __mmask16 is_nan = _mm512_cmp_ps_mask(value, value, _CMP_UNORD_Q);
+    rounded = _mm512_mask_or_epi32(rounded, is_nan, high,
+                                   _mm512_set1_epi32(0x40));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm512_cvtepi32_epi16(rounded));
+  }
+  dequant_scalar(src + i, dst + i, len - i, scale);
+}
+
+// VCVTNEPS2BF16 rounds to nearest even in hardware, it always flushes float
+// denormals which scaled weights never are
+__attribute__((target("avx512f,avx512bf16"))) inline void
+dequant_avx512_bf16(const uint8_t *src, bfloat16 *dst, size_t len,
+                    float scale) {
+  __m512 factor = _mm512_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m128i lo_bytes = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi_bytes = _mm_loadu_si128((const __m128i *)(src + i + 16));
+    __m512 lo = _mm512_mul_ps(e4m3_decode_avx512(lo_bytes), factor);
+    __m512 hi = _mm512_mul_ps(e4m3_decode_avx512(hi_bytes), factor);
+    // first operand lands in upper half
+    __m512bh packed = _mm512_cvtne2ps_pbh(hi, lo);
+    _mm512_storeu_si512(dst + i, (__m512i)packed);
+  }
+  dequant_scalar(src + i, dst + i, len - i, scale);
+}
+
+#pragma GCC diagnostic pop
+
+inline bool dequant_kernel_supported(DequantKernel kernel) {
+  switch (kernel) {
+  case DEQUANT_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case DEQUANT_AVX512:
+    return __builtin_cpu_supports("avx512f");
+  case DEQUANT_AVX512_BF16:
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bf16");
+  default:
+    return kernel < DEQUANT_KERNEL_COUNT;
+  }
+}
+
+inline DequantKernel best_dequant_kernel() {
+  for (int kernel = DEQUANT_KERNEL_COUNT - 1; kernel > DEQUANT_SCALAR;
+       kernel--) {
+    if (dequant_kernel_supported((DequantKernel)kernel)) {
+      return (DequantKernel)kernel;
+    }
+  }
+  return DEQUANT_SCALAR;
+}
+
+// "auto" means best supported kernel, DEQUANT_KERNEL_COUNT if unknown
+inline DequantKernel parse_dequant_kernel(const char *name) {
+  if (strcmp(name, "auto") == 0) {
+    return best_dequant_kernel();
+  }
+  for (int i = 0; i < DEQUANT_KERNEL_COUNT; i++) {
+    if (strcmp(name, dequant_kernel_names[i]) == 0) {
+      return (DequantKernel)i;
+    }
+  }
+  return DEQUANT_KERNEL_COUNT;
+}
+
+inline DequantFunc dequant_kernel_func(DequantKernel kernel) {
+  switch (kernel) {
+  case DEQUANT_AVX2:
+    return dequant_avx2;
+  case DEQUANT_AVX512:
+    return dequant_avx512;
+  case DEQUANT_AVX512_BF16:
+    return dequant_avx512_bf16;
+  default:
+    return dequant_scalar;
+  }
+}
+
+#endif
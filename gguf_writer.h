@@ -0,0 +1,669 @@
+// GGUF output of q8_bf16.cpp. Lays the catalog out as a GGUF v3 file
+// (header, tensor infos, then tensor data at 32 byte alignment) so the
+// converted model is written once in the format llama.cpp and ollama load,
+// and requantizes FP8 blocks straight to Q8_0. DeepSeek V2/V3 checkpoints
+// are mapped to llama.cpp's deepseek2 architecture: its tensor names, with
+// routed experts stacked into one tensor per projection, and hyperparameters
+// and tokenizer from config.json and tokenizer.json, so nothing has to
+// rewrite the file afterwards.
+#ifndef Q8_GGUF_WRITER_H
+#define Q8_GGUF_WRITER_H
+
+#include "dequant_kernel.h"
+#include "tensor_catalog.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+// ggml_type values as stored in the file
+enum GgmlType {
+  GGML_TYPE_F32 = 0,
+  GGML_TYPE_F16 = 1,
+  GGML_TYPE_Q8_0 = 8,
+  GGML_TYPE_I8 = 24,
+  GGML_TYPE_I16 = 25,
+  GGML_TYPE_I32 = 26,
+  GGML_TYPE_I64 = 27,
+  GGML_TYPE_F64 = 28,
+  GGML_TYPE_BF16 = 30
+};
+
+// llama_ftype recorded as general.file_type
+enum { GGUF_FTYPE_MOSTLY_Q8_0 = 7, GGUF_FTYPE_MOSTLY_BF16 = 32 };
+
+enum GgufValueType {
+  GGUF_TYPE_UINT32 = 4,
+  GGUF_TYPE_INT32 = 5,
+  GGUF_TYPE_FLOAT32 = 6,
+  GGUF_TYPE_BOOL = 7,
+  GGUF_TYPE_STRING = 8,
+  GGUF_TYPE_ARRAY = 9
+};
+
+// llama_token_type of tokenizer.ggml.token_type
+enum { TOKEN_NORMAL = 1, TOKEN_CONTROL = 3, TOKEN_USER_DEFINED = 4,
+       TOKEN_UNUSED = 5 };
+
+// llama_expert_gating_func_type
+enum { EXPERT_GATING_SOFTMAX = 1, EXPERT_GATING_SIGMOID = 2 };
+
+static const uint32_t gguf_version = 3;
+static const uint64_t gguf_alignment = 32;
+
+// 32 weights sharing one fp16 scale, ggml's block_q8_0
+static const int q8_0_block_size = 32;
+struct BlockQ8_0 {
+  uint16_t d;
+  int8_t qs[q8_0_block_size];
+};
+static_assert(sizeof(BlockQ8_0) == 34, "block_q8_0 is 34 bytes in ggml");
+
+// round to nearest even, overflow to inf, NaN stays NaN
+inline uint16_t float_to_half(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude > 0x7f800000) {
+    return sign | 0x7e00;
+  }
+  if (magnitude >= 0x477ff000) { // 65520 and up round to inf
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000) { // below 2^-14 is a half subnormal
+    float value;
+    memcpy(&value, &magnitude, sizeof(value));
+    return sign | (uint16_t)lrintf(value * 16777216.0f);
+  }
+  magnitude += 0xfff + ((magnitude >> 13) & 1);
+  return sign | ((magnitude - (112u << 23)) >> 13);
+}
+
+inline float half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  int exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+  float magnitude;
+  if (exponent == 0x1f) {
+    magnitude = mantissa ? NAN : INFINITY;
+  } else if (exponent == 0) {
+    magnitude = std::ldexp((float)mantissa, -24);
+  } else {
+    magnitude = std::ldexp((float)(1024 + mantissa), exponent - 25);
+  }
+  uint32_t bits;
+  memcpy(&bits, &magnitude, sizeof(bits));
+  bits |= sign;
+  memcpy(&magnitude, &bits, sizeof(magnitude));
+  return magnitude;
+}
+
+// Requantizes len FP8 values sharing one block scale into len / 32 Q8_0
+// blocks, as ggml's quantize_row_q8_0 would from the dequantized floats.
+// len is a multiple of 32, which 128 wide scale blocks always are.
+inline void quantize_q8_0(const uint8_t *src, BlockQ8_0 *dst, size_t len,
+                          float scale) {
+  for (size_t block = 0; block < len / q8_0_block_size; block++) {
+    const uint8_t *q = src + block * q8_0_block_size;
+    float values[q8_0_block_size];
+    float amax = 0;
+    for (int i = 0; i < q8_0_block_size; i++) {
+      values[i] = e4m3_table.value[q[i]] * scale;
+      if (std::isnan(values[i])) {
+        values[i] = 0;
+      }
+      amax = std::max(amax, std::fabs(values[i]));
+    }
+    float d = amax / 127;
+    float id = d != 0 ? 1.0f / d : 0.0f;
+    BlockQ8_0 out;
+    out.d = float_to_half(d);
+    for (int i = 0; i < q8_0_block_size; i++) {
+      out.qs[i] = (int8_t)roundf(values[i] * id);
+    }
+    memcpy(dst + block, &out, sizeof(out));
+  }
+}
+
+// -1 when ggml has no such type
+inline int ggmlType(DType dtype) {
+  switch (dtype) {
+  case DTYPE_F32:
+    return GGML_TYPE_F32;
+  case DTYPE_F16:
+    return GGML_TYPE_F16;
+  case DTYPE_BF16:
+    return GGML_TYPE_BF16;
+  case DTYPE_I8:
+    return GGML_TYPE_I8;
+  case DTYPE_I16:
+    return GGML_TYPE_I16;
+  case DTYPE_I32:
+    return GGML_TYPE_I32;
+  case DTYPE_I64:
+    return GGML_TYPE_I64;
+  case DTYPE_F64:
+    return GGML_TYPE_F64;
+  default:
+    return -1;
+  }
+}
+
+inline const char *ggmlTypeName(int type) {
+  switch (type) {
+  case GGML_TYPE_F32:
+    return "f32";
+  case GGML_TYPE_F16:
+    return "f16";
+  case GGML_TYPE_Q8_0:
+    return "q8_0";
+  case GGML_TYPE_I8:
+    return "i8";
+  case GGML_TYPE_I16:
+    return "i16";
+  case GGML_TYPE_I32:
+    return "i32";
+  case GGML_TYPE_I64:
+    return "i64";
+  case GGML_TYPE_F64:
+    return "f64";
+  case GGML_TYPE_BF16:
+    return "bf16";
+  default:
+    return "unknown";
+  }
+}
+
+inline void ggufU32(std::string &out, uint32_t value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline void ggufU64(std::string &out, uint64_t value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline void ggufString(std::string &out, const std::string &value) {
+  ggufU64(out, value.size());
+  out += value;
+}
+
+// Metadata key value pairs, counted as they are appended
+struct GgufKv {
+  std::string data;
+  uint64_t count = 0;
+
+  void key(const std::string &name, uint32_t type) {
+    ggufString(data, name);
+    ggufU32(data, type);
+    count++;
+  }
+  void addU32(const std::string &name, uint32_t value) {
+    key(name, GGUF_TYPE_UINT32);
+    ggufU32(data, value);
+  }
+  void addF32(const std::string &name, float value) {
+    key(name, GGUF_TYPE_FLOAT32);
+    data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  void addBool(const std::string &name, bool value) {
+    key(name, GGUF_TYPE_BOOL);
+    data += (char)value;
+  }
+  void addString(const std::string &name, const std::string &value) {
+    key(name, GGUF_TYPE_STRING);
+    ggufString(data, value);
+  }
+  void addStrings(const std::string &name,
+                  const std::vector<std::string> &values) {
+    key(name, GGUF_TYPE_ARRAY);
+    ggufU32(data, GGUF_TYPE_STRING);
+    ggufU64(data, values.size());
+    for (const std::string &value : values) {
+      ggufString(data, value);
+    }
+  }
+  void addI32s(const std::string &name, const std::vector<int32_t> &values) {
+    key(name, GGUF_TYPE_ARRAY);
+    ggufU32(data, GGUF_TYPE_INT32);
+    ggufU64(data, values.size());
+    data.append(reinterpret_cast<const char *>(values.data()),
+                values.size() * sizeof(int32_t));
+  }
+};
+
+// One tensor of the file, the stacked experts of a projection included
+struct GgufTensor {
+  std::string name;
+  std::vector<int64_t> shape; // outermost first, as in safetensors
+  int ggml_type = -1;
+  uint64_t offset = 0;
+};
+
+struct GgufModel {
+  int block_count = 0; // layers llama.cpp runs, MTP layers past it are left
+  GgufKv kv;
+  std::vector<GgufTensor> tensors;
+};
+
+// Names DeepSeek's special tokens carry, which llama.cpp treats as control
+// tokens even when tokenizer.json doesn't mark them special
+inline bool tokenLooksSpecial(const std::string &token) {
+  auto wrapped = [&](const std::string &open, const std::string &close) {
+    return token.size() >= open.size() + close.size() &&
+           token.compare(0, open.size(), open) == 0 &&
+           token.compare(token.size() - close.size(), close.size(), close) ==
+               0;
+  };
+  return token == "<pad>" || token == "<mask>" || wrapped("<|", "|>") ||
+         wrapped("<\xef\xbd\x9c", "\xef\xbd\x9c>");
+}
+
+// GPT-2 style BPE vocabulary of tokenizer.json as llama.cpp's gpt2 tokenizer
+// with DeepSeek V3's pre-tokenizer. Ids missing from the vocabulary up to
+// vocab_size are padding tokens.
+inline bool readGgufTokenizer(const std::string &model_path,
+                              const nlohmann::json &config, GgufKv &kv) {
+  std::string tokenizer_path = model_path + "/tokenizer.json";
+  std::ifstream f(tokenizer_path);
+  if (!f.is_open()) {
+    std::cerr << "Error: GGUF output needs " << tokenizer_path
+              << ", llama.cpp can't load a model without its tokenizer."
+              << std::endl;
+    return false;
+  }
+  std::vector<std::string> tokens;
+  std::vector<int32_t> token_types;
+  std::vector<std::string> merges;
+  try {
+    nlohmann::json tokenizer = nlohmann::json::parse(f);
+    const nlohmann::json &model = tokenizer.at("model");
+    size_t vocab_size = config.at("vocab_size").get<size_t>();
+    auto place = [&](size_t id, const std::string &token, int32_t type) {
+      if (id >= tokens.size()) {
+        tokens.resize(id + 1);
+        token_types.resize(id + 1, TOKEN_UNUSED);
+      }
+      tokens[id] = token;
+      token_types[id] = type;
+    };
+    for (const auto &[token, id] : model.at("vocab").items()) {
+      place(id.get<size_t>(), token, TOKEN_NORMAL);
+    }
+    if (tokenizer.contains("added_tokens")) {
+      for (const nlohmann::json &added : tokenizer["added_tokens"]) {
+        std::string token = added.at("content").get<std::string>();
+        bool special =
+            added.value("special", false) || tokenLooksSpecial(token);
+        place(added.at("id").get<size_t>(), token,
+              special ? TOKEN_CONTROL : TOKEN_USER_DEFINED);
+      }
+    }
+    if (tokens.size() < vocab_size) {
+      tokens.resize(vocab_size);
+      token_types.resize(vocab_size, TOKEN_UNUSED);
+    }
+    for (size_t id = 0; id < tokens.size(); id++) {
+      if (token_types[id] == TOKEN_UNUSED) {
+        tokens[id] = "[PAD" + std::to_string(id) + "]";
+      }
+    }
+    // newer tokenizers store a merge as a pair instead of "a b"
+    for (const nlohmann::json &merge : model.at("merges")) {
+      merges.push_back(merge.is_array() ? merge[0].get<std::string>() + " " +
+                                              merge[1].get<std::string>()
+                                        : merge.get<std::string>());
+    }
+  } catch (const nlohmann::json::exception &e) {
+    std::cerr << "Error parsing " << tokenizer_path << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  kv.addString("tokenizer.ggml.model", "gpt2");
+  kv.addString("tokenizer.ggml.pre", "deepseek-v3");
+  kv.addStrings("tokenizer.ggml.tokens", tokens);
+  kv.addI32s("tokenizer.ggml.token_type", token_types);
+  kv.addStrings("tokenizer.ggml.merges", merges);
+  if (config.contains("bos_token_id") && config["bos_token_id"].is_number()) {
+    kv.addU32("tokenizer.ggml.bos_token_id",
+              config["bos_token_id"].get<uint32_t>());
+  }
+  if (config.contains("eos_token_id") && config["eos_token_id"].is_number()) {
+    kv.addU32("tokenizer.ggml.eos_token_id",
+              config["eos_token_id"].get<uint32_t>());
+  }
+  std::ifstream tokenizer_config_file(model_path + "/tokenizer_config.json");
+  if (tokenizer_config_file.is_open()) {
+    try {
+      nlohmann::json tokenizer_config =
+          nlohmann::json::parse(tokenizer_config_file);
+      if (tokenizer_config.contains("add_bos_token")) {
+        kv.addBool("tokenizer.ggml.add_bos_token",
+                   tokenizer_config["add_bos_token"].get<bool>());
+      }
+      if (tokenizer_config.contains("chat_template") &&
+          tokenizer_config["chat_template"].is_string()) {
+        kv.addString("tokenizer.chat_template",
+                     tokenizer_config["chat_template"].get<std::string>());
+      }
+    } catch (const nlohmann::json::exception &e) {
+      std::cerr << "Error parsing " << model_path
+                << "/tokenizer_config.json: " << e.what() << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Metadata of a DeepSeek V2/V3 model under llama.cpp's deepseek2
+// architecture, the keys its convert_hf_to_gguf.py writes. Any other
+// model_type is refused, a file no loader knows the architecture of would be
+// of no use. An empty name falls back to _name_or_path of config.json.
+inline bool readGgufModel(const std::string &model_path,
+                          const std::string &name, bool q8_0,
+                          GgufModel &model) {
+  std::string config_path = model_path + "/config.json";
+  std::ifstream f(config_path);
+  nlohmann::json config;
+  try {
+    config = nlohmann::json::parse(f);
+  } catch (const nlohmann::json::exception &e) {
+    std::cerr << "Error parsing " << config_path << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  std::string model_type = config.value("model_type", "");
+  if (model_type != "deepseek_v3" && model_type != "deepseek_v2") {
+    std::cerr << "Error: --gguf maps DeepSeek V2/V3 to llama.cpp's deepseek2, "
+              << "model_type '" << model_type << "' isn't supported."
+              << std::endl;
+    return false;
+  }
+  const std::string arch = "deepseek2";
+  GgufKv &kv = model.kv;
+  kv.addString("general.architecture", arch);
+  kv.addString("general.name",
+               name.empty() ? config.value("_name_or_path", "") : name);
+  kv.addU32("general.alignment", gguf_alignment);
+  kv.addU32("general.file_type",
+            q8_0 ? GGUF_FTYPE_MOSTLY_Q8_0 : GGUF_FTYPE_MOSTLY_BF16);
+  try {
+    model.block_count = config.at("num_hidden_layers").get<int>();
+    kv.addU32(arch + ".block_count", model.block_count);
+    kv.addU32(arch + ".context_length",
+              config.at("max_position_embeddings").get<uint32_t>());
+    kv.addU32(arch + ".embedding_length",
+              config.at("hidden_size").get<uint32_t>());
+    kv.addU32(arch + ".feed_forward_length",
+              config.at("intermediate_size").get<uint32_t>());
+    kv.addU32(arch + ".attention.head_count",
+              config.at("num_attention_heads").get<uint32_t>());
+    kv.addU32(arch + ".attention.head_count_kv",
+              config.value("num_key_value_heads",
+                           config.at("num_attention_heads").get<uint32_t>()));
+    kv.addF32(arch + ".rope.freq_base", config.value("rope_theta", 10000.0f));
+    kv.addF32(arch + ".attention.layer_norm_rms_epsilon",
+              config.at("rms_norm_eps").get<float>());
+    kv.addU32(arch + ".expert_used_count",
+              config.at("num_experts_per_tok").get<uint32_t>());
+    kv.addU32(arch + ".vocab_size", config.at("vocab_size").get<uint32_t>());
+    kv.addU32(arch + ".leading_dense_block_count",
+              config.at("first_k_dense_replace").get<uint32_t>());
+    // V2-Lite projects q directly, without a low rank
+    if (config.contains("q_lora_rank") && config["q_lora_rank"].is_number()) {
+      kv.addU32(arch + ".attention.q_lora_rank",
+                config["q_lora_rank"].get<uint32_t>());
+    }
+    kv.addU32(arch + ".attention.kv_lora_rank",
+              config.at("kv_lora_rank").get<uint32_t>());
+    uint32_t rope_dim = config.at("qk_rope_head_dim").get<uint32_t>();
+    kv.addU32(arch + ".attention.key_length",
+              config.at("qk_nope_head_dim").get<uint32_t>() + rope_dim);
+    kv.addU32(arch + ".attention.value_length",
+              config.at("v_head_dim").get<uint32_t>());
+    kv.addU32(arch + ".expert_feed_forward_length",
+              config.at("moe_intermediate_size").get<uint32_t>());
+    kv.addU32(arch + ".expert_count",
+              config.at("n_routed_experts").get<uint32_t>());
+    kv.addU32(arch + ".expert_shared_count",
+              config.at("n_shared_experts").get<uint32_t>());
+    kv.addF32(arch + ".expert_weights_scale",
+              config.at("routed_scaling_factor").get<float>());
+    kv.addBool(arch + ".expert_weights_norm",
+               config.value("norm_topk_prob", false));
+    kv.addU32(arch + ".expert_gating_func",
+              config.value("scoring_func", "softmax") == "sigmoid"
+                  ? EXPERT_GATING_SIGMOID
+                  : EXPERT_GATING_SOFTMAX);
+    kv.addU32(arch + ".rope.dimension_count", rope_dim);
+    nlohmann::json rope_scaling =
+        config.value("rope_scaling", nlohmann::json::object());
+    if (!rope_scaling.is_object()) {
+      rope_scaling = nlohmann::json::object();
+    }
+    if (rope_scaling.value("type", rope_scaling.value("rope_type", "")) ==
+            "yarn" &&
+        rope_scaling.contains("factor")) {
+      kv.addString(arch + ".rope.scaling.type", "yarn");
+      kv.addF32(arch + ".rope.scaling.factor",
+                rope_scaling["factor"].get<float>());
+      kv.addU32(arch + ".rope.scaling.original_context_length",
+                rope_scaling.at("original_max_position_embeddings")
+                    .get<uint32_t>());
+      kv.addF32(arch + ".rope.scaling.yarn_log_multiplier",
+                0.1f * rope_scaling.value("mscale_all_dim", 0.0f));
+    }
+  } catch (const nlohmann::json::exception &e) {
+    std::cerr << "Error: " << config_path << " lacks a DeepSeek "
+              << "hyperparameter: " << e.what() << std::endl;
+    return false;
+  }
+  return readGgufTokenizer(model_path, config, kv);
+}
+
+// llama.cpp deepseek2 name of a DeepSeek tensor, empty for the multi token
+// prediction layers past block_count which llama.cpp doesn't load. expert is
+// the routed expert the tensor is a slice of, -1 otherwise. kv_b_proj stays
+// whole as attn_kv_b, the file targets llama.cpp's non-MLA deepseek2 path
+// which loads it as is. false for a name it has no tensor for.
+inline bool deepseek2TensorName(const std::string &hf_name, int block_count,
+                                std::string &name, int &expert) {
+  static const std::map<std::string, std::string> model_names = {
+      {"model.embed_tokens.weight", "token_embd.weight"},
+      {"model.norm.weight", "output_norm.weight"},
+      {"lm_head.weight", "output.weight"}};
+  static const std::map<std::string, std::string> layer_names = {
+      {"input_layernorm", "attn_norm"},
+      {"post_attention_layernorm", "ffn_norm"},
+      {"self_attn.q_proj", "attn_q"},
+      {"self_attn.q_a_proj", "attn_q_a"},
+      {"self_attn.q_a_layernorm", "attn_q_a_norm"},
+      {"self_attn.q_b_proj", "attn_q_b"},
+      {"self_attn.kv_a_proj_with_mqa", "attn_kv_a_mqa"},
+      {"self_attn.kv_a_layernorm", "attn_kv_a_norm"},
+      {"self_attn.kv_b_proj", "attn_kv_b"},
+      {"self_attn.o_proj", "attn_output"},
+      {"mlp.gate_proj", "ffn_gate"},
+      {"mlp.up_proj", "ffn_up"},
+      {"mlp.down_proj", "ffn_down"},
+      {"mlp.shared_experts.gate_proj", "ffn_gate_shexp"},
+      {"mlp.shared_experts.up_proj", "ffn_up_shexp"},
+      {"mlp.shared_experts.down_proj", "ffn_down_shexp"},
+      {"mlp.gate", "ffn_gate_inp"},
+      {"mlp.experts.gate_proj", "ffn_gate_exps"},
+      {"mlp.experts.up_proj", "ffn_up_exps"},
+      {"mlp.experts.down_proj", "ffn_down_exps"}};
+  expert = -1;
+  auto global = model_names.find(hf_name);
+  if (global != model_names.end()) {
+    name = global->second;
+    return true;
+  }
+  const std::string layers = "model.layers.";
+  if (hf_name.compare(0, layers.size(), layers) != 0) {
+    return false;
+  }
+  char *end;
+  long layer = strtol(hf_name.c_str() + layers.size(), &end, 10);
+  if (*end != '.') {
+    return false;
+  }
+  if (layer >= block_count) {
+    name.clear();
+    return true;
+  }
+  std::string rest = end + 1;
+  std::string prefix = "blk." + std::to_string(layer) + ".";
+  if (rest == "mlp.gate.e_score_correction_bias") {
+    name = prefix + "exp_probs_b.bias";
+    return true;
+  }
+  const std::string experts = "mlp.experts.";
+  if (rest.compare(0, experts.size(), experts) == 0) {
+    expert = strtol(rest.c_str() + experts.size(), &end, 10);
+    if (*end != '.') {
+      return false;
+    }
+    rest = experts + (end + 1);
+  }
+  size_t dot = rest.rfind('.');
+  if (dot == std::string::npos) {
+    return false;
+  }
+  auto module = layer_names.find(rest.substr(0, dot));
+  std::string suffix = rest.substr(dot + 1);
+  if (module == layer_names.end() || (suffix != "weight" && suffix != "bias")) {
+    return false;
+  }
+  name = prefix + module->second + "." + suffix;
+  return true;
+}
+
+// Relays the catalog out as a single GGUF data section under llama.cpp's
+// names. Converted weights are BF16, or Q8_0 with q8_0 when the weight is
+// FP8 and its rows are whole Q8_0 blocks. 1D BF16 and F16 tensors (norms)
+// are widened to F32, the only norm weight type ggml multiplies with.
+// Routed experts of a projection become one tensor, every expert a slice of
+// it. Scale tensors folded into their weight and MTP layers are dropped.
+// Fails on a tensor or dtype llama.cpp has no place for.
+inline bool layoutGguf(TensorCatalog &catalog, bool q8_0, GgufModel &model) {
+  for (TensorEntry &entry : catalog.entries) {
+    if (entry.out_dtype != entry.dtype && entry.scale != -1) {
+      catalog.entries[entry.scale].dropped = true;
+    }
+  }
+  std::map<std::string, size_t> tensor_ids;
+  std::vector<std::vector<std::pair<int, size_t>>> members; // expert, entry
+  for (size_t i = 0; i < catalog.entries.size(); i++) {
+    TensorEntry &entry = catalog.entries[i];
+    if (entry.dropped) {
+      continue;
+    }
+    std::string name;
+    int expert;
+    if (!deepseek2TensorName(entry.name, model.block_count, name, expert)) {
+      std::cerr << "Error: Tensor " << entry.name
+                << " has no place in llama.cpp's deepseek2." << std::endl;
+      return false;
+    }
+    if (name.empty()) {
+      entry.dropped = true;
+      continue;
+    }
+    if (entry.shape.size() <= 1 &&
+        (entry.dtype == DTYPE_BF16 || entry.dtype == DTYPE_F16)) {
+      entry.out_dtype = DTYPE_F32;
+    }
+    if (q8_0 && entry.dtype == DTYPE_F8_E4M3 &&
+        entry.out_dtype != entry.dtype &&
+        entry.shape[1] % q8_0_block_size == 0) {
+      entry.out_ggml_type = GGML_TYPE_Q8_0;
+      entry.out_end = entry.elements() / q8_0_block_size * sizeof(BlockQ8_0);
+    } else {
+      entry.out_ggml_type = ggmlType(entry.out_dtype);
+      entry.out_end = entry.elements() * dtype_sizes[entry.out_dtype];
+    }
+    if (entry.out_ggml_type == -1) {
+      std::cerr << "Error: Tensor " << entry.name << " has dtype "
+                << dtype_names[entry.out_dtype] << " which GGUF can't hold."
+                << std::endl;
+      return false;
+    }
+    auto [it, added] = tensor_ids.emplace(name, model.tensors.size());
+    if (added) {
+      model.tensors.push_back({name, entry.shape, entry.out_ggml_type, 0});
+      members.emplace_back();
+    }
+    members[it->second].emplace_back(expert, i);
+  }
+
+  // out_end holds the entry's size until its slot is known
+  uint64_t current_offset = 0;
+  for (size_t t = 0; t < model.tensors.size(); t++) {
+    GgufTensor &tensor = model.tensors[t];
+    std::vector<std::pair<int, size_t>> &slices = members[t];
+    std::sort(slices.begin(), slices.end());
+    const TensorEntry &first = catalog.entries[slices[0].second];
+    for (size_t k = 0; k < slices.size(); k++) {
+      const TensorEntry &slice = catalog.entries[slices[k].second];
+      if (slices[k].first != (slices[0].first == -1 ? -1 : (int)k) ||
+          slice.shape != first.shape ||
+          slice.out_ggml_type != first.out_ggml_type) {
+        std::cerr << "Error: Tensor " << slice.name << " doesn't stack into "
+                  << tensor.name << " as expert " << k << "." << std::endl;
+        return false;
+      }
+    }
+    if (slices[0].first != -1) {
+      tensor.shape.insert(tensor.shape.begin(), slices.size());
+    }
+    current_offset = (current_offset + gguf_alignment - 1) /
+                     gguf_alignment * gguf_alignment;
+    tensor.offset = current_offset;
+    for (auto &[expert, index] : slices) {
+      TensorEntry &slice = catalog.entries[index];
+      uint64_t bytes = slice.out_end;
+      slice.out_shard = 0;
+      slice.out_begin = current_offset;
+      slice.out_end = current_offset + bytes;
+      current_offset = slice.out_end;
+    }
+  }
+  catalog.out_sizes.assign(1, current_offset);
+  return true;
+}
+
+// Everything before the data section: header, metadata, tensor infos and
+// padding up to the alignment. ne is the shape reversed, innermost first.
+inline std::string ggufHeader(const GgufModel &model) {
+  std::string out = "GGUF";
+  ggufU32(out, gguf_version);
+  ggufU64(out, model.tensors.size());
+  ggufU64(out, model.kv.count);
+  out += model.kv.data;
+
+  for (const GgufTensor &tensor : model.tensors) {
+    ggufString(out, tensor.name);
+    // a scalar is one element of one dimension to ggml
+    ggufU32(out, std::max<size_t>(tensor.shape.size(), 1));
+    if (tensor.shape.empty()) {
+      ggufU64(out, 1);
+    }
+    for (auto dim = tensor.shape.rbegin(); dim != tensor.shape.rend(); ++dim) {
+      ggufU64(out, *dim);
+    }
+    ggufU32(out, tensor.ggml_type);
+    ggufU64(out, tensor.offset);
+  }
+  out.resize((out.size() + gguf_alignment - 1) / gguf_alignment *
+                 gguf_alignment,
+             '\0');
+  return out;
+}
+
+#endif
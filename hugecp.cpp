@@ -1,86 +1,1833 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <linux/magic.h>
 #include <dirent.h>
 #include <map>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <getopt.h>
+#include <nmmintrin.h>
+#include "copy_kernel.h"
+#ifdef HUGECP_ZSTD
+// build with -DHUGECP_ZSTD -lzstd to read .zst sources, frame header and stable output buffer
+// are only in the experimental api
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#endif
 
 using namespace std;
 
 extern int errno;
 
-#ifdef HUGEPAGE_SIZE_1G
-#define HUGE_PAGE_SIZE 1073741824
-//  sanity test
 static_assert(sizeof(off_t) == 8);
-static_assert(HUGE_PAGE_SIZE == 1073741824);
-#else
-#define HUGE_PAGE_SIZE 2097152
+
+// page size is read from target's hugetlbfs mount, this is only used when target is elsewhere
+#define DEFAULT_PAGE_SIZE 2097152
+// every worker grabs this much of the target at a time, rounded up to multiple of page size
+#define MIN_CHUNK_SIZE 16777216
+// default for largest single io_uring read and bounce buffer of copy kernels,
+// sized for throughput and small enough to stay in L2, whatever the page size is
+#define TRANSFER_SIZE 1048576
+// pread path hashes data in pieces this big right after they land, while still in L2
+#define INLINE_HASH_SIZE 524288
+
+// O_DIRECT reads need buffer, file offset and length aligned to logical block size
+#define DIRECT_IO_ALIGN 4096
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // linux 5.14
+#endif
+// bytes per lane of 3-way interleaved hardware crc32c
+#define CRC32C_LANE_SIZE 4096
+
+struct SourceFile {
+    string name;
+    off_t size;
+    off_t offset; // where this file starts inside target mapping
+    int fd;
+    struct timespec mtime;
+    vector<uint32_t> pageCrc; // crc32c of file bytes inside each page it touches
+    uint32_t crc;
+    bool crcKnown;
+    int directFd; // same file opened with O_DIRECT, -1 when not used
+    bool compressed; // .zst, size and offset are of decompressed data
+    string layoutHeader; // rewritten safetensors header with length prefix, empty when copied as is
+};
+
+// compressed and relocated files are put in place before chunks are handed out
+bool filledUpFront(const SourceFile& file) {
+    return file.compressed || !file.layoutHeader.empty();
+}
+
+// binary manifest: header, one record per target page which doubles as copy journal,
+// then one entry per source file followed by its name
+#define MANIFEST_MAGIC "HUGECPM1"
+#define MANIFEST_VERSION 2
+#define PAGE_MISSING 0
+#define PAGE_WRITTEN 1
+
+struct ManifestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fileCount;
+    uint64_t pageSize;
+    uint64_t targetSize;
+    uint64_t alignment; // 0 when files are packed back to back
+    uint64_t targetDev; // identify hugetlbfs file the pages were written to
+    uint64_t targetIno;
+    uint32_t complete;  // 1 once whole copy succeeded
+    uint32_t tensorAlignment; // 0 when safetensors layout is kept
+};
+
+struct ManifestPage {
+    uint32_t crc32c; // of source bytes inside page
+    uint32_t state;
+};
+
+struct ManifestEntry {
+    uint64_t offset;
+    uint64_t length;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t crc32c;
+    uint32_t nameLength;
+};
+
+static int64_t pageSize  = DEFAULT_PAGE_SIZE;
+static bool tgtHugetlbfs = false; // otherwise target is a plain file on tmpfs or disk, mapped without MAP_HUGETLB
+static int64_t chunkSize = 0;
+static int64_t minChunkSize = MIN_CHUNK_SIZE;
+static int64_t transferSize = TRANSFER_SIZE; // --buffer-size
+static off_t srcSize = 0;
+static off_t dataSize = 0; // end of last source file inside target
+static int64_t tgtSize = 0;
+static bool computeChecksum = false;
+static bool alignFiles = false;
+static int64_t tensorAlign = 0; // --tensor-align, 0 keeps safetensors layout as it is
+static int manifestFd = -1;
+static struct stat tgtStat;
+static vector<ManifestPage> pages;
+static vector<char> cleanPages; // update mode: page already holds right data
+static atomic<off_t> totalCopySize(0);
+static atomic<bool> copyFailed(false);
+static atomic<int64_t> verifyMismatch(0);
+static vector<SourceFile> sources;
+static bool useIoUring = false;
+static unsigned queueDepth = 32;
+static CopyKernel copyKernel = COPY_DIRECT;
+static CopyFunc copyFunc = copyMemcpy;
+static bool useDirect = false;
+// --mem-budget: cap on source bytes we let sit in page cache, 0 is unlimited
+static off_t memBudget = 0;
+static off_t cacheInUse = 0;
+static atomic<off_t> cachePeak(0);
+static mutex budgetMutex;
+static condition_variable budgetCond;
+
+enum NumaMode {
+    NUMA_NONE,
+    NUMA_INTERLEAVE, // pages round robin over nodes
+    NUMA_BIND,       // pages only from given nodes
+    NUMA_SPLIT,      // target cut into one contiguous range per node
+};
+
+// chunks [next, end) not yet handed out, one queue per node in split mode
+struct ChunkQueue {
+    atomic<int64_t> next;
+    int64_t end;
+    int node;
+};
+
+static NumaMode numaMode = NUMA_NONE;
+static vector<int> numaNodes;
+static vector<ChunkQueue> chunkQueues;
+
+// progress line is redrawn at most this often, plain log lines when stdout is not a terminal
+#define PROGRESS_INTERVAL_MS 500
+#define PROGRESS_LOG_INTERVAL_MS 10000
+// throughput is sampled this often for --stats-json
+#define STATS_SAMPLE_MS 1000
+// read latency histogram bucket i counts reads taking [2^i, 2^(i+1)) microseconds
+#define LATENCY_BUCKETS 32
+
+// first read started and last read finished of a source file, monotonic ns
+struct FileTiming {
+    atomic<int64_t> firstNs{INT64_MAX};
+    atomic<int64_t> lastNs{0};
+};
+
+static int64_t startNs = 0;
+static atomic<int> runningWorkers(0);
+static atomic<uint64_t> readLatency[LATENCY_BUCKETS];
+static atomic<int64_t> readNs(0);
+static atomic<int64_t> faultNs(0); // time spent faulting in target pages
+static atomic<int64_t> faultPages(0);
+static atomic<int64_t> prefaultPages(0);
+static int64_t prefaultNs = 0;
+static unique_ptr<FileTiming[]> fileTimings;
+static vector<pair<int64_t, off_t>> throughput; // (ns since start, bytes copied) samples
+
+int64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void recordReadLatency(int64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : min(63 - __builtin_clzll(us), LATENCY_BUCKETS - 1);
+    readLatency[bucket]++;
+    readNs += ns;
+}
+
+void recordFileTime(const SourceFile& file, int64_t begin, int64_t end) {
+    if (!fileTimings) return;
+    FileTiming& timing = fileTimings[&file - sources.data()];
+    for (int64_t v = timing.firstNs; begin < v && !timing.firstNs.compare_exchange_weak(v, begin); ) {}
+    for (int64_t v = timing.lastNs; end > v && !timing.lastNs.compare_exchange_weak(v, end); ) {}
+}
+
+void update_progress(off_t done, off_t total, double rate, double etaRate, bool tty) {
+    int bar_length = 40; // Modify this to change the bar's length
+    int progress = total > 0 ? (int)(done * 100 / total) : 100;
+    int filled_length = (int)(bar_length * progress / 100.0);
+    char bar[bar_length + 1]; // +1 for the null terminator
+    for (int i = 0; i < bar_length; i++) {
+        if (i < filled_length) {
+            bar[i] = '=';
+        } else {
+            bar[i] = '-';
+        }
+    }
+    bar[bar_length] = '\0'; // Null-terminate the string
+    char eta[32] = "--";
+    if (etaRate > 0 && done < total) {
+        long seconds = (long)((total - done) / etaRate);
+        snprintf(eta, sizeof(eta), "%ldm%02lds", seconds / 60, seconds % 60);
+    }
+    printf("%s[%s] %d%% %.2f/%.2f GB %.2f GB/s ETA %s%s", tty ? "\r" : "", bar, progress, done / 1e9, total / 1e9,
+        rate / 1e9, eta, tty ? "" : "\n");
+    fflush(stdout); // Ensure output is written immediately
+}
+
+// main thread waits for workers here, redrawing progress line at limited rate instead of
+// every worker printing after each chunk, and samples throughput for --stats-json
+void monitorWorkers(vector<thread>& workers, off_t total) {
+    bool tty = isatty(STDOUT_FILENO);
+    int64_t interval = (tty ? PROGRESS_INTERVAL_MS : PROGRESS_LOG_INTERVAL_MS) * 1000000L;
+    int64_t lastPrint = startNs, lastSample = startNs;
+    off_t lastDone = 0;
+    while (runningWorkers > 0) {
+        usleep(50000);
+        int64_t now = nowNs();
+        off_t done = totalCopySize;
+        if (now - lastSample >= STATS_SAMPLE_MS * 1000000L) {
+            throughput.push_back({now - startNs, done});
+            lastSample = now;
+        }
+        if (now - lastPrint >= interval) {
+            // current rate for display, average rate for eta so it doesn't jump around
+            update_progress(done, total, (done - lastDone) * 1e9 / (now - lastPrint), done * 1e9 / (now - startNs), tty);
+            lastPrint = now;
+            lastDone = done;
+        }
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    int64_t now = nowNs();
+    off_t done = totalCopySize;
+    throughput.push_back({now - startNs, done});
+    double average = now > startNs ? done * 1e9 / (now - startNs) : 0;
+    update_progress(done, total, average, average, tty);
+}
+
+uint32_t crc32c(uint32_t crc, const char *data, size_t len);
+
+// pread until all len bytes of file land at dst, short read is only an error at EOF.
+// with crc given data is hashed in small steps right after each read.
+// aligned part goes through O_DIRECT descriptor when there is one, unaligned tail through page cache
+bool readFully(const SourceFile& file, off_t fileOffset, char *dst, off_t len, uint32_t *crc = nullptr) {
+    while (len > 0) {
+        off_t want = crc ? min(len, (off_t)INLINE_HASH_SIZE) : len;
+        bool direct = file.directFd != -1 && want >= DIRECT_IO_ALIGN &&
+            (((uintptr_t)dst | fileOffset) & (DIRECT_IO_ALIGN - 1)) == 0;
+        if (direct) want &= ~(off_t)(DIRECT_IO_ALIGN - 1);
+        int64_t begin = nowNs();
+        ssize_t size = pread(direct ? file.directFd : file.fd, dst, want, fileOffset);
+        recordReadLatency(nowNs() - begin);
+        if (size == -1) {
+            if (errno == EINTR) continue;
+            printf("read source file %s failed with error %s\n", file.name.c_str(), strerror(errno));
+            return false;
+        }
+        if (size == 0) {
+            printf("source file %s is truncated at offset %lu\n", file.name.c_str(), fileOffset);
+            return false;
+        }
+        if (crc) *crc = crc32c(*crc, dst, size);
+        dst += size;
+        fileOffset += size;
+        len -= size;
+        totalCopySize += size;
+    }
+    return true;
+}
+
+static uint32_t crc32cTable[8][256];
+// advance raw crc state over CRC32C_LANE_SIZE and twice that many zero bytes
+static uint32_t crc32cShift1[4][256], crc32cShift2[4][256];
+static uint32_t (*crc32cImpl)(uint32_t crc, const char *data, size_t len);
+
+// slicing-by-8 crc32c (castagnoli), little endian only
+uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32cTable[7][v & 0xff] ^ crc32cTable[6][(v >> 8) & 0xff] ^
+              crc32cTable[5][(v >> 16) & 0xff] ^ crc32cTable[4][(v >> 24) & 0xff] ^
+              crc32cTable[3][(v >> 32) & 0xff] ^ crc32cTable[2][(v >> 40) & 0xff] ^
+              crc32cTable[1][(v >> 48) & 0xff] ^ crc32cTable[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+void gf2MatrixSquare(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2MatrixTimes(mat, mat[n]);
+}
+
+// crc32c of A+B from crc of A, crc of B and length of B (same trick as zlib crc32_combine)
+uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    if (len2 == 0) return crc1;
+    uint32_t even[32], odd[32];
+    odd[0] = 0x82F63B78;
+    for (int n = 1; n < 32; n++) odd[n] = 1U << (n - 1);
+    gf2MatrixSquare(even, odd); // 2 zero bits
+    gf2MatrixSquare(odd, even); // 4 zero bits
+    do {
+        gf2MatrixSquare(even, odd);
+        if (len2 & 1) crc1 = gf2MatrixTimes(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        gf2MatrixSquare(odd, even);
+        if (len2 & 1) crc1 = gf2MatrixTimes(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+    return crc1 ^ crc2;
+}
+
+uint32_t crc32cShift(const uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+// SSE4.2 crc32 instruction has 3 cycle latency and 1 cycle throughput, so run three
+// independent lanes and stitch them together with precomputed shift tables
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const char *data, size_t len) {
+    const char *p = data;
+    uint64_t state = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        state = _mm_crc32_u8(state, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC32C_LANE_SIZE) {
+        uint64_t lane1 = 0, lane2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE_SIZE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC32C_LANE_SIZE + i, 8);
+            memcpy(&v2, p + 2 * CRC32C_LANE_SIZE + i, 8);
+            state = _mm_crc32_u64(state, v0);
+            lane1 = _mm_crc32_u64(lane1, v1);
+            lane2 = _mm_crc32_u64(lane2, v2);
+        }
+        state = crc32cShift(crc32cShift2, state) ^ crc32cShift(crc32cShift1, lane1) ^ lane2;
+        p += 3 * CRC32C_LANE_SIZE;
+        len -= 3 * CRC32C_LANE_SIZE;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        state = _mm_crc32_u64(state, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        state = _mm_crc32_u8(state, *p++);
+    }
+    return ~(uint32_t)state;
+}
+
+void initCrc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xff];
+        }
+    }
+    crc32cImpl = crc32cSoftware;
+    if (__builtin_cpu_supports("sse4.2")) {
+        // combine of raw state with zero crc is exactly the zero bytes shift
+        for (int k = 0; k < 4; k++) {
+            for (uint32_t b = 0; b < 256; b++) {
+                crc32cShift1[k][b] = crc32cCombine(b << (8 * k), 0, CRC32C_LANE_SIZE);
+                crc32cShift2[k][b] = crc32cCombine(b << (8 * k), 0, 2 * CRC32C_LANE_SIZE);
+            }
+        }
+        crc32cImpl = crc32cSse42;
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const char *data, size_t len) {
+    return crc32cImpl(crc, data, len);
+}
+
+// move len bytes of file to dst in target. direct kernel preads straight into target,
+// others read through small bounce buffer which stays in cache and fill target with copy kernel
+bool fillFromSource(const SourceFile& file, off_t fileOffset, char *dst, off_t len, uint32_t *crc) {
+    if (copyKernel == COPY_DIRECT) {
+        return readFully(file, fileOffset, dst, len, crc);
+    }
+    // aligned so O_DIRECT can read into it as well
+    thread_local unique_ptr<char, decltype(&free)> buffer((char *)aligned_alloc(DIRECT_IO_ALIGN, transferSize), free);
+    while (len > 0) {
+        off_t size = min(len, (off_t)transferSize);
+        if (!readFully(file, fileOffset, buffer.get(), size, crc)) {
+            return false;
+        }
+        copyFunc(dst, buffer.get(), size);
+        dst += size;
+        fileOffset += size;
+        len -= size;
+    }
+    return true;
+}
+
+// first file which ends after pos
+vector<SourceFile>::iterator findSource(off_t pos) {
+    return upper_bound(sources.begin(), sources.end(), pos,
+        [](off_t pos, const SourceFile& file) { return pos < file.offset + file.size; });
+}
+
+// hand out next chunk [begin, end) of target to a worker, false when nothing left.
+// worker drains its home queue first then helps the others
+bool nextChunkRange(size_t home, off_t& begin, off_t& end) {
+    for (size_t k = 0; k < chunkQueues.size() && !copyFailed; k++) {
+        ChunkQueue& queue = chunkQueues[(home + k) % chunkQueues.size()];
+        if (queue.next >= queue.end) continue;
+        int64_t i = queue.next++;
+        if (i >= queue.end) continue;
+        begin = i * chunkSize;
+        end = min(begin + chunkSize, dataSize);
+        return true;
+    }
+    return false;
+}
+
+// page is clean when update mode found it already holds the right bytes
+bool isCleanPage(int64_t page) {
+    return !cleanPages.empty() && cleanPages[page];
+}
+
+// first position >= pos inside a page which must be copied, or end
+off_t skipCleanPages(off_t pos, off_t end) {
+    while (pos < end && isCleanPage(pos / pageSize)) pos = (pos / pageSize + 1) * pageSize;
+    return min(pos, end);
+}
+
+// end of run of pages to copy which starts at pos
+off_t dirtyRunEnd(off_t pos, off_t end) {
+    while (pos < end && !isCleanPage(pos / pageSize)) pos = (pos / pageSize + 1) * pageSize;
+    return min(pos, end);
+}
+
+// with --mem-budget a worker reserves budget for a whole chunk before reading it and gives it
+// back once chunk is dropped from page cache, so source footprint stays under budget.
+// one chunk is always allowed so a budget below chunk size still makes progress
+bool acquireBudget(off_t len, bool wait) {
+    if (memBudget == 0) return true;
+    unique_lock<mutex> lock(budgetMutex);
+    auto fits = [&] { return cacheInUse == 0 || cacheInUse + len <= memBudget || copyFailed; };
+    if (!wait && !fits()) return false;
+    // failed workers don't release, so look at copyFailed now and then
+    while (!budgetCond.wait_for(lock, chrono::milliseconds(100), fits)) {}
+    cacheInUse += len;
+    if (cacheInUse > cachePeak) cachePeak = cacheInUse;
+    return true;
+}
+
+void releaseBudget(off_t len) {
+    if (memBudget == 0) return;
+    {
+        lock_guard<mutex> lock(budgetMutex);
+        cacheInUse -= len;
+    }
+    budgetCond.notify_all();
+}
+
+// posix_fadvise source bytes which land in target range [begin, end)
+void adviseSources(off_t begin, off_t end, int advice) {
+    for (auto it = findSource(begin); it != sources.end() && it->offset < end; it++) {
+        if (filledUpFront(*it)) continue; // frames and tensor pieces advise their own range
+        off_t from = max(begin, it->offset);
+        off_t to = min(end, it->offset + it->size);
+        posix_fadvise(it->fd, from - it->offset, to - from, advice);
+    }
+}
+
+// kick readahead of whole chunk before worker starts reading it, skipping pages --update keeps
+void prefetchChunk(off_t begin, off_t end) {
+    if (memBudget == 0) return;
+    for (off_t pos = skipCleanPages(begin, end); pos < end; ) {
+        off_t runEnd = dirtyRunEnd(pos, end);
+        adviseSources(pos, runEnd, POSIX_FADV_WILLNEED);
+        pos = skipCleanPages(runEnd, end);
+    }
+}
+
+// chunk is in target now, drop its source pages behind the copy cursor and return budget
+void dropChunk(off_t begin, off_t end) {
+    if (memBudget == 0) return;
+    adviseSources(begin, end, POSIX_FADV_DONTNEED);
+    releaseBudget(chunkSize);
+}
+
+// crc32c of file bytes inside given page
+uint32_t hashFilePiece(char *tgtBase, SourceFile& file, int64_t page) {
+    off_t from = max(page * pageSize, file.offset);
+    off_t to = min((page + 1) * pageSize, file.offset + file.size);
+    return file.pageCrc[page - file.offset / pageSize] = crc32c(0, tgtBase + from, to - from);
+}
+
+// record pages [first, first + count) in manifest journal so an interrupted copy can be resumed
+void journalPages(int64_t first, int64_t count) {
+    off_t pos = sizeof(ManifestHeader) + first * sizeof(ManifestPage);
+    if (pwrite(manifestFd, &pages[first], count * sizeof(ManifestPage), pos) != (ssize_t)(count * sizeof(ManifestPage))) {
+        printf("write manifest journal failed %s\n", strerror(errno));
+    }
+}
+
+// called once all source bytes of [begin, end) have landed in target while they are still warm,
+// hashed tells file pieces were already hashed by the reads themselves
+void finishChunk(char *tgtBase, off_t begin, off_t end, bool hashed) {
+    if (!computeChecksum) return;
+    int64_t firstPage = begin / pageSize, lastPage = (end + pageSize - 1) / pageSize;
+    for (int64_t page = firstPage; page < lastPage; page++) {
+        if (!isCleanPage(page)) pages[page].crc32c = 0;
+    }
+    // page crc only covers source bytes, alignment padding is not part of it
+    for (auto it = findSource(begin); it != sources.end() && it->offset < end; it++) {
+        int64_t from = max(begin, it->offset) / pageSize;
+        int64_t to = (min(end, it->offset + it->size) + pageSize - 1) / pageSize;
+        for (int64_t page = from; page < to; page++) {
+            if (isCleanPage(page)) continue;
+            ManifestPage& record = pages[page];
+            off_t length = min((page + 1) * pageSize, it->offset + it->size) - max(page * pageSize, it->offset);
+            uint32_t crc = hashed ? it->pageCrc[page - it->offset / pageSize] : hashFilePiece(tgtBase, *it, page);
+            record.crc32c = crc32cCombine(record.crc32c, crc, length);
+        }
+    }
+    for (int64_t page = firstPage; page < lastPage; page++) {
+        if (!isCleanPage(page)) pages[page].state = PAGE_WRITTEN;
+    }
+    if (manifestFd != -1) {
+        journalPages(firstPage, lastPage - firstPage);
+    }
+}
+
+// fold per page crc of every file into whole file crc, files kept from previous copy already have it
+void combineFileCrc(char *tgtBase) {
+    for (auto& file : sources) {
+        if (file.crcKnown) continue;
+        file.crc = 0;
+        off_t pos = file.offset;
+        for (size_t i = 0; i < file.pageCrc.size(); i++) {
+            int64_t page = file.offset / pageSize + i;
+            off_t pageEnd = min(file.offset + file.size, (page + 1) * pageSize);
+            // pages skipped in update mode were not hashed while copying
+            uint32_t pageCrc = isCleanPage(page) ? hashFilePiece(tgtBase, file, page) : file.pageCrc[i];
+            file.crc = crc32cCombine(file.crc, pageCrc, pageEnd - pos);
+            pos = pageEnd;
+        }
+        file.crcKnown = true;
+    }
+}
+
+void writeJsonString(FILE *fp, const string& str) {
+    fputc('"', fp);
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// file name as seen by loader, relative to source directory
+// compressed sources are listed under decompressed name, that is what target holds
+string manifestName(const SourceFile& file) {
+    const char *slash = strrchr(file.name.c_str(), '/');
+    string name = slash ? slash + 1 : file.name.c_str();
+    if (file.compressed) name.resize(name.size() - 4);
+    return name;
+}
+
+// write header, page journal and file entries of binary manifest
+bool writeManifestTables(bool complete) {
+    ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.fileCount = sources.size();
+    header.pageSize = pageSize;
+    header.targetSize = tgtSize;
+    header.alignment = alignFiles ? pageSize : 0;
+    header.tensorAlignment = tensorAlign;
+    header.targetDev = tgtStat.st_dev;
+    header.targetIno = tgtStat.st_ino;
+    header.complete = complete;
+    string buf((char *)&header, sizeof(header));
+    buf.append((char *)pages.data(), pages.size() * sizeof(ManifestPage));
+    for (auto& file : sources) {
+        string name = manifestName(file);
+        ManifestEntry entry = {(uint64_t)file.offset, (uint64_t)file.size, file.mtime.tv_sec, file.mtime.tv_nsec,
+            file.crcKnown ? file.crc : 0, (uint32_t)name.size()};
+        buf.append((char *)&entry, sizeof(entry));
+        buf.append(name);
+    }
+    if (pwrite(manifestFd, buf.data(), buf.size(), 0) != (ssize_t)buf.size() ||
+        ftruncate(manifestFd, buf.size()) != 0 || fdatasync(manifestFd) != 0) {
+        printf("write manifest failed %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// manifest cannot live on hugetlbfs which doesn't support write()
+bool createManifest(const string& path) {
+    manifestFd = open(path.c_str(), O_CREAT | O_RDWR, 0666);
+    if (manifestFd == -1) {
+        printf("manifest file %s cannot be opened! %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    return writeManifestTables(false);
+}
+
+// mark binary manifest complete and write same content as json to path.json
+bool finishManifest(const string& path, const char *tgtName) {
+    bool result = writeManifestTables(true);
+    close(manifestFd);
+    manifestFd = -1;
+
+    string jsonPath = path + ".json";
+    FILE *fp = fopen(jsonPath.c_str(), "w");
+    if (!fp) {
+        printf("manifest file %s cannot be opened! %s\n", jsonPath.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(fp, "{\n  \"target\": ");
+    writeJsonString(fp, tgtName);
+    fprintf(fp, ",\n  \"page_size\": %ld,\n  \"target_size\": %ld,\n  \"alignment\": %ld,\n"
+        "  \"tensor_alignment\": %ld,\n  \"checksum\": \"crc32c\",\n  \"files\": [", pageSize, tgtSize,
+        alignFiles ? pageSize : 0, tensorAlign);
+    for (size_t i = 0; i < sources.size(); i++) {
+        const SourceFile& file = sources[i];
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        writeJsonString(fp, manifestName(file));
+        fprintf(fp, ", \"offset\": %ld, \"length\": %ld, \"mtime_sec\": %ld, \"mtime_nsec\": %ld, "
+            "\"crc32c\": %u}", file.offset, file.size, file.mtime.tv_sec, file.mtime.tv_nsec, file.crc);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fclose(fp) != 0) {
+        printf("write manifest %s failed %s\n", jsonPath.c_str(), strerror(errno));
+        result = false;
+    }
+    return result;
+}
+
+// --stats-json: throughput over time, read latency histogram, page fault time and per file timing,
+// lets orchestration spot slow disks and size load windows
+bool writeStats(const char *path, const char *srcName, const char *tgtName, bool result, int threadNumber) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        printf("stats file %s cannot be opened! %s\n", path, strerror(errno));
+        return false;
+    }
+    int64_t elapsed = throughput.empty() ? 0 : throughput.back().first;
+    off_t done = totalCopySize;
+    fprintf(fp, "{\n  \"result\": \"%s\",\n  \"source\": ", result ? "success" : "failed");
+    writeJsonString(fp, srcName);
+    fprintf(fp, ",\n  \"target\": ");
+    writeJsonString(fp, tgtName);
+    fprintf(fp, ",\n  \"threads\": %d,\n  \"io_uring\": %s,\n  \"copy_kernel\": \"%s\",\n  \"page_size\": %ld,\n"
+        "  \"source_size\": %ld,\n  \"bytes_copied\": %ld,\n  \"seconds\": %.3f,\n  \"bytes_per_sec\": %.0f,\n",
+        threadNumber, useIoUring ? "true" : "false", copyKernelNames[copyKernel], pageSize, srcSize, done,
+        elapsed / 1e9, elapsed > 0 ? done * 1e9 / elapsed : 0.0);
+
+    uint64_t reads = 0;
+    for (auto& count : readLatency) reads += count;
+    fprintf(fp, "  \"read_latency_us\": {\"reads\": %lu, \"mean\": %.1f, \"buckets\": [", reads,
+        reads ? readNs / 1e3 / reads : 0.0);
+    bool first = true;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (readLatency[i] == 0) continue;
+        fprintf(fp, "%s\n    {\"from\": %lu, \"to\": %lu, \"count\": %lu}", first ? "" : ",",
+            i ? 1UL << i : 0, 2UL << i, readLatency[i].load());
+        first = false;
+    }
+    fprintf(fp, "\n  ]},\n  \"page_faults\": {\"pages\": %ld, \"seconds\": %.3f},\n"
+        "  \"prefault\": {\"pages\": %ld, \"seconds\": %.3f},\n"
+        "  \"source_cache\": {\"budget\": %ld, \"peak\": %ld, \"direct\": %s},\n  \"throughput\": [",
+        faultPages.load(), faultNs / 1e9, prefaultPages.load(), prefaultNs / 1e9, memBudget, cachePeak.load(),
+        useDirect ? "true" : "false");
+    int64_t lastTime = 0;
+    off_t lastBytes = 0;
+    for (size_t i = 0; i < throughput.size(); i++) {
+        auto& [time, bytes] = throughput[i];
+        fprintf(fp, "%s\n    {\"t\": %.3f, \"bytes\": %ld, \"bytes_per_sec\": %.0f}", i ? "," : "", time / 1e9,
+            bytes, time > lastTime ? (bytes - lastBytes) * 1e9 / (time - lastTime) : 0.0);
+        lastTime = time;
+        lastBytes = bytes;
+    }
+    fprintf(fp, "\n  ],\n  \"files\": [");
+    for (size_t i = 0; i < sources.size(); i++) {
+        const FileTiming& timing = fileTimings[i];
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        writeJsonString(fp, manifestName(sources[i]));
+        fprintf(fp, ", \"size\": %ld", sources[i].size);
+        if (timing.firstNs <= timing.lastNs) {
+            // files without any read (empty or kept by --update) only have size
+            int64_t span = timing.lastNs - timing.firstNs;
+            fprintf(fp, ", \"start\": %.3f, \"end\": %.3f, \"seconds\": %.3f", (timing.firstNs - startNs) / 1e9,
+                (timing.lastNs - startNs) / 1e9, span / 1e9);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fclose(fp) != 0) {
+        printf("write stats %s failed %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// previous copy as recorded in binary manifest
+struct OldManifest {
+    ManifestHeader header;
+    vector<ManifestPage> pages;
+    vector<ManifestEntry> entries;
+    vector<string> names;
+};
+
+bool loadManifest(const string& path, OldManifest& old) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        printf("manifest file %s cannot be opened! %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    bool result = fread(&old.header, sizeof(old.header), 1, fp) == 1 &&
+        memcmp(old.header.magic, MANIFEST_MAGIC, sizeof(old.header.magic)) == 0 &&
+        old.header.version == MANIFEST_VERSION && old.header.pageSize > 0;
+    if (result) {
+        old.pages.resize(old.header.targetSize / old.header.pageSize);
+        result = old.pages.empty() || fread(old.pages.data(), sizeof(ManifestPage), old.pages.size(), fp) == old.pages.size();
+    }
+    for (uint32_t i = 0; result && i < old.header.fileCount; i++) {
+        ManifestEntry entry;
+        result = fread(&entry, sizeof(entry), 1, fp) == 1;
+        string name(result ? entry.nameLength : 0, '\0');
+        result = result && (entry.nameLength == 0 || fread(&name[0], entry.nameLength, 1, fp) == 1);
+        old.entries.push_back(entry);
+        old.names.push_back(name);
+    }
+    fclose(fp);
+    if (!result) {
+        printf("manifest file %s is not a valid hugecp manifest\n", path.c_str());
+    }
+    return result;
+}
+
+// files overlapping page in a layout sorted by offset, empty files never overlap anything
+template <typename T, typename Offset, typename Size>
+pair<size_t, size_t> filesOfPage(const vector<T>& files, int64_t page, Offset offset, Size size) {
+    size_t first = upper_bound(files.begin(), files.end(), page * pageSize,
+        [&](off_t pos, const T& file) { return pos < (off_t)(offset(file) + size(file)); }) - files.begin();
+    size_t last = first;
+    while (last < files.size() && (off_t)offset(files[last]) < (page + 1) * pageSize) last++;
+    return {first, last};
+}
+
+// update mode: page can be kept when previous copy finished it from exactly the same files at same place.
+// returns number of source bytes which don't need copy again
+off_t markCleanPages(const OldManifest& old, const struct stat& st) {
+    if (old.header.pageSize != (uint64_t)pageSize || old.header.alignment != (uint64_t)(alignFiles ? pageSize : 0) ||
+        old.header.tensorAlignment != tensorAlign ||
+        old.header.targetDev != st.st_dev || old.header.targetIno != st.st_ino) {
+        printf("target or layout changed since previous copy, copy everything\n");
+        return 0;
+    }
+    int64_t pageNumber = tgtSize / pageSize;
+    int64_t existing = min((int64_t)old.pages.size(), (int64_t)(st.st_size / pageSize));
+    cleanPages.assign(pageNumber, 0);
+    auto oldOffset = [](const ManifestEntry& e) { return e.offset; };
+    auto oldSize = [](const ManifestEntry& e) { return e.length; };
+    auto newOffset = [](const SourceFile& f) { return f.offset; };
+    auto newSize = [](const SourceFile& f) { return f.size; };
+    off_t cleanBytes = 0;
+    for (int64_t page = 0; page < min(pageNumber, existing); page++) {
+        if (old.pages[page].state != PAGE_WRITTEN) continue;
+        auto [oldFirst, oldLast] = filesOfPage(old.entries, page, oldOffset, oldSize);
+        auto [newFirst, newLast] = filesOfPage(sources, page, newOffset, newSize);
+        bool same = oldLast - oldFirst == newLast - newFirst;
+        for (size_t i = 0; same && i < newLast - newFirst; i++) {
+            const ManifestEntry& entry = old.entries[oldFirst + i];
+            const SourceFile& file = sources[newFirst + i];
+            same = old.names[oldFirst + i] == manifestName(file) && entry.offset == (uint64_t)file.offset &&
+                entry.length == (uint64_t)file.size && entry.mtimeSec == file.mtime.tv_sec &&
+                entry.mtimeNsec == file.mtime.tv_nsec;
+        }
+        if (!same) continue;
+        cleanPages[page] = 1;
+        pages[page] = old.pages[page];
+        for (size_t i = newFirst; i < newLast; i++) {
+            const SourceFile& file = sources[i];
+            cleanBytes += min((page + 1) * pageSize, file.offset + file.size) - max(page * pageSize, file.offset);
+        }
+    }
+    // untouched files keep crc of previous copy if it finished
+    for (auto& file : sources) {
+        if (!old.header.complete) break;
+        for (size_t i = 0; i < old.entries.size(); i++) {
+            const ManifestEntry& entry = old.entries[i];
+            if (old.names[i] == manifestName(file) && entry.offset == (uint64_t)file.offset &&
+                entry.length == (uint64_t)file.size && entry.mtimeSec == file.mtime.tv_sec &&
+                entry.mtimeNsec == file.mtime.tv_nsec) {
+                file.crc = entry.crc32c;
+                file.crcKnown = true;
+                break;
+            }
+        }
+    }
+    return cleanBytes;
+}
+
+// parse node list like "0,2-3"
+bool parseNodeList(const char *str, vector<int>& nodes) {
+    nodes.clear();
+    while (*str) {
+        char *next;
+        long first = strtol(str, &next, 10), last = first;
+        if (next == str || first < 0) return false;
+        if (*next == '-') {
+            str = next + 1;
+            last = strtol(str, &next, 10);
+            if (next == str || last < first) return false;
+        }
+        for (long node = first; node <= last; node++) nodes.push_back(node);
+        str = next;
+        if (*str == ',') str++;
+        else if (*str != '\0' && *str != '\n') return false;
+        else break;
+    }
+    return !nodes.empty();
+}
+
+bool readSysfsLine(const string& path, char *line, int size) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) return false;
+    bool result = fgets(line, size, fp) != nullptr;
+    fclose(fp);
+    return result;
+}
+
+// pin calling thread onto cpus of given nodes
+void pinToNodes(const vector<int>& nodes) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int node : nodes) {
+        char line[4096];
+        vector<int> cpuList;
+        if (!readSysfsLine("/sys/devices/system/node/node" + to_string(node) + "/cpulist", line, sizeof(line)) ||
+            !parseNodeList(line, cpuList)) {
+            continue;
+        }
+        for (int cpu : cpuList) {
+            if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+        }
+    }
+    if (CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        printf("pin thread to numa node failed %s\n", strerror(errno));
+    }
+}
+
+bool applyMemPolicy(void *addr, off_t len, int mode, const vector<int>& nodes) {
+    unsigned long mask[16] = {0};
+    for (int node : nodes) {
+        if (node >= (int)(sizeof(mask) * 8)) {
+            printf("numa node %d is out of range\n", node);
+            return false;
+        }
+        mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+    }
+    if (syscall(SYS_mbind, addr, len, mode, mask, sizeof(mask) * 8 + 1, 0) != 0) {
+        printf("mbind target range failed %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// set up chunk queues and bind target range before any page of it is faulted in
+bool setupNumaPlacement(char *tgtBase) {
+    int64_t chunkNumber = (dataSize + chunkSize - 1) / chunkSize;
+    switch (numaMode) {
+        case NUMA_NONE:
+            break;
+        case NUMA_INTERLEAVE:
+            if (!applyMemPolicy(tgtBase, tgtSize, MPOL_INTERLEAVE, numaNodes)) return false;
+            break;
+        case NUMA_BIND:
+            if (!applyMemPolicy(tgtBase, tgtSize, MPOL_BIND, numaNodes)) return false;
+            break;
+        case NUMA_SPLIT: {
+            chunkQueues = vector<ChunkQueue>(numaNodes.size());
+            for (size_t i = 0; i < numaNodes.size(); i++) {
+                ChunkQueue& queue = chunkQueues[i];
+                queue.next = chunkNumber * i / numaNodes.size();
+                queue.end = chunkNumber * (i + 1) / numaNodes.size();
+                queue.node = numaNodes[i];
+                // chunks are page aligned, and last node takes tail page
+                off_t begin = queue.next * chunkSize;
+                off_t end = i + 1 == numaNodes.size() ? tgtSize : queue.end * chunkSize;
+                if (end > begin && !applyMemPolicy(tgtBase + begin, end - begin, MPOL_BIND, {queue.node})) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    chunkQueues = vector<ChunkQueue>(1);
+    chunkQueues[0].next = 0;
+    chunkQueues[0].end = chunkNumber;
+    chunkQueues[0].node = -1;
+    return true;
+}
+
+// ask kernel where every huge page of target ended up
+void reportNumaPlacement(char *tgtBase) {
+    int64_t pageNumber = tgtSize / pageSize;
+    vector<void *> pages(pageNumber);
+    vector<int> status(pageNumber, -1);
+    for (int64_t i = 0; i < pageNumber; i++) pages[i] = tgtBase + i * pageSize;
+    if (syscall(SYS_move_pages, 0, pageNumber, pages.data(), NULL, status.data(), 0) != 0) {
+        printf("query numa placement failed %s\n", strerror(errno));
+        return;
+    }
+    map<int, int64_t> pagesPerNode;
+    for (int node : status) pagesPerNode[node]++;
+    printf("numa placement of %ld huge pages:\n", pageNumber);
+    for (auto& [node, count] : pagesPerNode) {
+        if (node >= 0) {
+            printf("node %d: %ld pages %lu bytes\n", node, count, count * pageSize);
+        } else {
+            printf("not present (%s): %ld pages\n", strerror(-node), count);
+        }
+    }
+}
+
+// touch target pages of [begin, end) which are about to be written, so time kernel spends
+// allocating and zeroing huge pages is measured apart from read latency
+void faultInPages(char *tgtBase, off_t begin, off_t end) {
+    int64_t start = nowNs(), count = 0;
+    for (int64_t page = begin / pageSize; page * pageSize < end; page++) {
+        if (isCleanPage(page)) continue;
+        volatile char *p = tgtBase + max(begin, page * pageSize);
+        *p = *p;
+        count++;
+    }
+    faultNs += nowNs() - start;
+    faultPages += count;
+}
+
+// huge pages of given size nobody has taken or reserved yet, on given numa nodes or whole system,
+// -1 when kernel doesn't tell
+int64_t freeHugePages(int64_t size, const vector<int>& nodes) {
+    char line[64];
+    string dir = "hugepages/hugepages-" + to_string(size / 1024) + "kB/";
+    if (!nodes.empty()) {
+        // per node counters have no reservation count
+        int64_t free = 0;
+        for (int node : nodes) {
+            if (!readSysfsLine("/sys/devices/system/node/node" + to_string(node) + "/" + dir + "free_hugepages",
+                    line, sizeof(line))) {
+                return -1;
+            }
+            free += atoll(line);
+        }
+        return free;
+    }
+    if (readSysfsLine("/sys/kernel/mm/" + dir + "free_hugepages", line, sizeof(line))) {
+        int64_t free = atoll(line);
+        if (readSysfsLine("/sys/kernel/mm/" + dir + "resv_hugepages", line, sizeof(line))) {
+            free -= atoll(line);
+        }
+        return free;
+    }
+    // old kernels only have default size in meminfo
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) return -1;
+    int64_t free = -1, reserved = 0, defaultSize = 0;
+    char buf[256];
+    while (fgets(buf, sizeof(buf), fp)) {
+        sscanf(buf, "HugePages_Free: %ld", &free);
+        sscanf(buf, "HugePages_Rsvd: %ld", &reserved);
+        if (sscanf(buf, "Hugepagesize: %ld", &defaultSize) == 1) defaultSize *= 1024;
+    }
+    fclose(fp);
+    return defaultSize == size && free >= 0 ? free - reserved : -1;
+}
+
+// refuse before anything is copied when hugetlbfs cannot hold whole target, otherwise we only
+// find out from mmap or a SIGBUS hundreds of GB later
+bool checkHugePageCapacity(int tgtFd, const char *tgtName) {
+    struct statfs fs;
+    if (fstatfs(tgtFd, &fs) != 0) {
+        printf("statfs target %s failed %s\n", tgtName, strerror(errno));
+        return false;
+    }
+    if (fs.f_type != HUGETLBFS_MAGIC) {
+        printf("target %s is not on hugetlbfs, skip huge page capacity check\n", tgtName);
+        return true;
+    }
+    if (fs.f_bsize != pageSize) {
+        printf("target %s is on hugetlbfs with page size %ld but hugecp copies with page size %ld\n", tgtName,
+            (int64_t)fs.f_bsize, pageSize);
+        return false;
+    }
+    // pages target file already holds (update mode) are not needed again
+    int64_t needed = tgtSize / pageSize - min(tgtSize / pageSize, (int64_t)(tgtStat.st_blocks * 512 / pageSize));
+    if (fs.f_blocks > 0 && (int64_t)fs.f_bavail < needed) {
+        printf("hugetlbfs mount of %s is limited to %ld pages and only %ld are free, target needs %ld more\n",
+            tgtName, (int64_t)fs.f_blocks, (int64_t)fs.f_bavail, needed);
+        return false;
+    }
+    bool onNodes = numaMode == NUMA_BIND || numaMode == NUMA_SPLIT;
+    int64_t free = freeHugePages(pageSize, onNodes ? numaNodes : vector<int>());
+    if (free >= 0 && free < needed) {
+        printf("only %ld free huge pages of %ld bytes%s, target needs %ld, raise nr_hugepages first\n", free,
+            pageSize, onNodes ? " on selected numa nodes" : "", needed);
+        return false;
+    }
+    if (free >= 0 && numaMode == NUMA_SPLIT) {
+        // every node has to hold its own share
+        for (size_t i = 0; i < numaNodes.size(); i++) {
+            int64_t share = needed * (i + 1) / numaNodes.size() - needed * i / numaNodes.size();
+            int64_t nodeFree = freeHugePages(pageSize, {numaNodes[i]});
+            if (nodeFree >= 0 && nodeFree < share) {
+                printf("numa node %d has only %ld free huge pages, its share of target needs %ld\n", numaNodes[i],
+                    nodeFree, share);
+                return false;
+            }
+        }
+    }
+    printf("huge page capacity check: target needs %ld pages of %ld bytes, %ld free\n", needed, pageSize, free);
+    return true;
+}
+
+// copy target range [begin, end) from all source files overlapping it
+bool copyRange(char *tgtBase, off_t begin, off_t end) {
+    for (auto it = findSource(begin); it != sources.end() && it->offset < end; it++) {
+        off_t from = max(begin, it->offset);
+        off_t to = min(end, it->offset + it->size);
+        if (filledUpFront(*it)) {
+            // frames or tensor pieces already filled this range, only page crc is left
+            for (int64_t page = from / pageSize; computeChecksum && page * pageSize < to; page++) {
+                hashFilePiece(tgtBase, *it, page);
+            }
+            continue;
+        }
+        int64_t start = nowNs();
+        if (!computeChecksum) {
+            if (!fillFromSource(*it, from - it->offset, tgtBase + from, to - from, nullptr)) {
+                return false;
+            }
+            recordFileTime(*it, start, nowNs());
+            continue;
+        }
+        // checksum is kept per file piece of each page
+        while (from < to) {
+            off_t pieceEnd = min(to, (from / pageSize + 1) * pageSize);
+            uint32_t crc = 0;
+            if (!fillFromSource(*it, from - it->offset, tgtBase + from, pieceEnd - from, &crc)) {
+                return false;
+            }
+            it->pageCrc[from / pageSize - it->offset / pageSize] = crc;
+            from = pieceEnd;
+        }
+        recordFileTime(*it, start, nowNs());
+    }
+    return true;
+}
+
+// minimal io_uring built on raw syscalls so we don't depend on liburing
+struct IoUring {
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0;
+};
+
+void closeIoUring(IoUring& ring) {
+    if (ring.sqes != nullptr && ring.entries) munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    if (ring.sqRing != MAP_FAILED) munmap(ring.sqRing, ring.sqRingSize);
+    if (ring.cqRing != MAP_FAILED) munmap(ring.cqRing, ring.cqRingSize);
+    if (ring.fd != -1) close(ring.fd);
+    ring.fd = -1;
+}
+
+bool setupIoUring(IoUring& ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.sqes = nullptr;
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0) {
+        ring.fd = -1;
+        return false;
+    }
+    ring.entries = params.sq_entries;
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQ_RING);
+    ring.cqRing = mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) ring.sqes = (struct io_uring_sqe *)sqes;
+        closeIoUring(ring);
+        return false;
+    }
+    char *sq = (char *)ring.sqRing, *cq = (char *)ring.cqRing;
+    ring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.sqes = (struct io_uring_sqe *)sqes;
+    return true;
+}
+
+// one read in flight, iovec must stay alive until its completion is reaped
+struct IoUringRead {
+    const SourceFile *file;
+    off_t fileOffset;
+    struct iovec iov;
+    size_t chunk; // index into worker's pending chunks
+    int64_t submitNs;
+    int fd; // O_DIRECT descriptor while read is block aligned
+};
+
+// chunk whose reads are in flight, finished once all queued reads completed
+struct PendingChunk {
+    off_t begin, end;
+    off_t remaining;
+    bool queued;
+};
+
+void queueIoUringRead(IoUring& ring, IoUringRead& read, unsigned slot) {
+    unsigned tail = *ring.sqTail;
+    unsigned index = tail & *ring.sqMask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = read.fd;
+    sqe->off = read.fileOffset;
+    sqe->addr = (unsigned long)&read.iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    read.submitNs = nowNs();
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// keep queueDepth reads in flight landing directly in target mapping, no bounce buffer
+bool ioUringCopy(IoUring& ring, char *tgtBase, size_t home) {
+    unsigned depth = min(queueDepth, ring.entries);
+    vector<IoUringRead> reads(depth);
+    vector<unsigned> freeSlots;
+    for (unsigned i = 0; i < depth; i++) freeSlots.push_back(depth - 1 - i);
+    vector<PendingChunk> chunks;
+    vector<size_t> freeChunks;
+    size_t current = 0;
+    unsigned inFlight = 0, toSubmit = 0;
+    off_t pos = 0, end = 0;
+    bool moreWork = true, result = true;
+    auto completeRead = [&](size_t chunk, off_t size) {
+        PendingChunk& pending = chunks[chunk];
+        pending.remaining -= size;
+        if (pending.queued && pending.remaining == 0) {
+            if (result) finishChunk(tgtBase, pending.begin, pending.end, false);
+            dropChunk(pending.begin, pending.end);
+            freeChunks.push_back(chunk);
+        }
+    };
+
+    while (moreWork || inFlight > 0) {
+        // split current chunk into reads which never cross a source file
+        while (moreWork && !freeSlots.empty()) {
+            if (pos == end) {
+                // with reads in flight go reap them instead of blocking on budget they will free
+                if (!acquireBudget(chunkSize, inFlight == 0)) break;
+                if (!nextChunkRange(home, pos, end)) {
+                    releaseBudget(chunkSize);
+                    moreWork = false;
+                    break;
+                }
+                if (freeChunks.empty()) {
+                    freeChunks.push_back(chunks.size());
+                    chunks.push_back({});
+                }
+                current = freeChunks.back();
+                freeChunks.pop_back();
+                chunks[current] = {pos, end, 0, false};
+                prefetchChunk(pos, end);
+                faultInPages(tgtBase, pos, end);
+            }
+            pos = skipCleanPages(pos, end);
+            auto file = findSource(pos);
+            if (pos == end || file == sources.end() || file->offset >= end) {
+                // rest of chunk is alignment padding or already in place
+                pos = end;
+            } else if (file->offset > pos) {
+                pos = file->offset;
+            } else if (filledUpFront(*file)) {
+                // filled before chunks are handed out, finishChunk hashes it from target
+                pos = min(end, file->offset + file->size);
+            } else {
+                off_t len = min(min(dirtyRunEnd(pos, end), file->offset + file->size) - pos, (off_t)transferSize);
+                // file start is aligned when it has O_DIRECT descriptor, so only length matters
+                bool direct = file->directFd != -1 && len >= DIRECT_IO_ALIGN && pos % DIRECT_IO_ALIGN == 0;
+                if (direct) len &= ~(off_t)(DIRECT_IO_ALIGN - 1);
+                unsigned slot = freeSlots.back();
+                freeSlots.pop_back();
+                reads[slot] = {&*file, pos - file->offset, {tgtBase + pos, (size_t)len}, current, 0,
+                    direct ? file->directFd : file->fd};
+                queueIoUringRead(ring, reads[slot], slot);
+                chunks[current].remaining += len;
+                pos += len;
+                inFlight++;
+                toSubmit++;
+            }
+            if (pos == end) {
+                chunks[current].queued = true;
+                completeRead(current, 0);
+            }
+        }
+        if (inFlight == 0) break;
+        int ret = syscall(__NR_io_uring_enter, ring.fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            // ring is unusable, nothing more can complete
+            printf("io_uring_enter failed %s\n", strerror(errno));
+            return false;
+        }
+        toSubmit -= ret;
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            unsigned slot = cqe->user_data;
+            IoUringRead& read = reads[slot];
+            int res = cqe->res;
+            int64_t now = nowNs();
+            recordReadLatency(now - read.submitNs);
+            if (result && (res == -EINTR || res == -EAGAIN)) {
+                queueIoUringRead(ring, read, slot);
+                toSubmit++;
+                continue;
+            }
+            if (res < 0) {
+                printf("read source file %s failed with error %s\n", read.file->name.c_str(), strerror(-res));
+                result = false;
+            } else if (res == 0) {
+                printf("source file %s is truncated at offset %lu\n", read.file->name.c_str(), read.fileOffset);
+                result = false;
+            } else {
+                totalCopySize += res;
+                recordFileTime(*read.file, read.submitNs, now);
+                completeRead(read.chunk, res);
+                if (result && (size_t)res < read.iov.iov_len) {
+                    // short read, queue the rest again
+                    read.fileOffset += res;
+                    read.iov.iov_base = (char *)read.iov.iov_base + res;
+                    read.iov.iov_len -= res;
+                    if ((read.fileOffset | read.iov.iov_len) & (DIRECT_IO_ALIGN - 1)) read.fd = read.file->fd;
+                    queueIoUringRead(ring, read, slot);
+                    toSubmit++;
+                    continue;
+                }
+            }
+            freeSlots.push_back(slot);
+            inFlight--;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        if (!result || copyFailed) {
+            // stop queueing but drain outstanding reads, they target our mapping
+            moreWork = false;
+            result = false;
+        }
+    }
+    return result;
+}
+
+bool preadAll(int fd, void *buf, size_t len, off_t pos) {
+    return pread(fd, buf, len, pos) == (ssize_t)len;
+}
+
+// source bytes inside pages of [begin, end) which update mode doesn't keep
+off_t dirtyBytes(off_t begin, off_t end) {
+    off_t bytes = 0;
+    for (off_t pos = skipCleanPages(begin, end); pos < end; ) {
+        off_t runEnd = dirtyRunEnd(pos, end);
+        bytes += runEnd - pos;
+        pos = skipCleanPages(runEnd, end);
+    }
+    return bytes;
+}
+
+// --tensor-align: tensors of a .safetensors source move to aligned offsets inside target, so an engine
+// mapping the hugepage file gets aligned zero-copy tensors. header is rewritten with new data_offsets
+// and padded with spaces until data section starts aligned too
+struct TensorPiece {
+    size_t file;        // index into sources
+    off_t sourceOffset; // of data inside source file, -1 for rewritten header
+    off_t targetOffset; // where padding before data starts inside target
+    off_t padding;      // zero bytes in front of data
+    off_t size;         // padding included
+};
+
+static vector<TensorPiece> tensorPieces;
+static atomic<size_t> nextTensorPiece(0);
+static atomic<size_t> tensorPiecesDone(0);
+
+bool isSafetensorsName(const string& name) {
+    return name.size() > 12 && name.compare(name.size() - 12, 12, ".safetensors") == 0;
+}
+
+// just enough json for safetensors header, values are kept as raw text and only data_offsets is parsed
+struct JsonCursor {
+    const string& text;
+    size_t pos;
+
+    void skipSpace() {
+        while (pos < text.size() && isspace((unsigned char)text[pos])) pos++;
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (pos >= text.size() || text[pos] != c) return false;
+        pos++;
+        return true;
+    }
+
+    // next string, object, array or scalar as it is written, quotes and escapes included
+    bool rawValue(string& value) {
+        skipSpace();
+        size_t start = pos;
+        int depth = 0;
+        bool inString = false;
+        for (; pos < text.size(); pos++) {
+            char c = text[pos];
+            if (inString) {
+                if (c == '\\') {
+                    pos++; // escaped character can't end string
+                } else if (c == '"') {
+                    inString = false;
+                    if (depth == 0) break;
+                }
+            } else if (c == '"') {
+                inString = true;
+            } else if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (depth == 0) break;
+                if (--depth == 0) break;
+            } else if (depth == 0 && (c == ',' || isspace((unsigned char)c))) {
+                break;
+            }
+        }
+        if (pos < text.size() && pos > start && (text[pos] == '"' || text[pos] == '}' || text[pos] == ']') &&
+            (text[start] == '"' || text[start] == '{' || text[start] == '[')) {
+            pos++; // closing quote or bracket belongs to value
+        }
+        value = text.substr(start, pos - start);
+        return pos > start && !inString && depth == 0;
+    }
+};
+
+struct SafetensorsEntry {
+    string name;                         // raw json string
+    string value;                        // raw value of __metadata__
+    vector<pair<string, string>> fields; // raw key and value of tensor, data_offsets left out
+    uint64_t begin, end;                 // data_offsets, relative to data section
+    bool tensor;
+};
+
+bool parseSafetensorsHeader(const string& header, vector<SafetensorsEntry>& entries) {
+    JsonCursor json = {header, 0};
+    if (!json.consume('{')) return false;
+    if (json.consume('}')) return true;
+    do {
+        SafetensorsEntry entry = {};
+        if (!json.rawValue(entry.name) || entry.name[0] != '"' || !json.consume(':')) return false;
+        entry.tensor = entry.name != "\"__metadata__\"";
+        if (!entry.tensor) {
+            if (!json.rawValue(entry.value)) return false;
+            entries.push_back(entry);
+            continue;
+        }
+        bool hasOffsets = false;
+        if (!json.consume('{')) return false;
+        do {
+            string key, value;
+            if (!json.rawValue(key) || key[0] != '"' || !json.consume(':') || !json.rawValue(value)) return false;
+            if (key == "\"data_offsets\"") {
+                unsigned long begin, end;
+                hasOffsets = sscanf(value.c_str(), "[ %lu , %lu ]", &begin, &end) == 2 && begin <= end;
+                entry.begin = begin;
+                entry.end = end;
+            } else {
+                entry.fields.push_back({key, value});
+            }
+        } while (json.consume(','));
+        if (!hasOffsets || !json.consume('}')) return false;
+        entries.push_back(entry);
+    } while (json.consume(','));
+    return json.consume('}');
+}
+
+// rewrite header of safetensors source with tensors at tensorAlign boundaries and queue copy of
+// every tensor, split so big ones are shared by workers. returns new file size, -1 on error
+off_t layoutSafetensors(SourceFile& file, size_t fileIndex) {
+    struct stat st;
+    uint64_t headerLength;
+    if (fstat(file.fd, &st) != 0 || !preadAll(file.fd, &headerLength, sizeof(headerLength), 0) ||
+        headerLength > (uint64_t)st.st_size - sizeof(headerLength)) {
+        printf("source file %s is not a safetensors file\n", file.name.c_str());
+        return -1;
+    }
+    string header(headerLength, '\0');
+    vector<SafetensorsEntry> entries;
+    off_t dataStart = sizeof(headerLength) + headerLength;
+    if (!preadAll(file.fd, &header[0], headerLength, sizeof(headerLength)) ||
+        !parseSafetensorsHeader(header, entries)) {
+        printf("source file %s has invalid safetensors header\n", file.name.c_str());
+        return -1;
+    }
+    // tensors keep their order in data section so source is still read sequentially
+    vector<SafetensorsEntry *> order;
+    for (auto& entry : entries) {
+        if (!entry.tensor) continue;
+        if (entry.end > (uint64_t)(st.st_size - dataStart)) {
+            printf("tensor %s of %s is outside of file\n", entry.name.c_str(), file.name.c_str());
+            return -1;
+        }
+        order.push_back(&entry);
+    }
+    sort(order.begin(), order.end(), [](auto a, auto b) { return a->begin < b->begin; });
+    vector<uint64_t> placed(order.size());
+    uint64_t dataLength = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        placed[i] = (dataLength + tensorAlign - 1) / tensorAlign * tensorAlign;
+        dataLength = placed[i] + order[i]->end - order[i]->begin;
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        uint64_t length = order[i]->end - order[i]->begin;
+        order[i]->fields.push_back({"\"data_offsets\"", "[" + to_string(placed[i]) + "," + to_string(placed[i] + length) + "]"});
+    }
+
+    string json = "{";
+    for (auto& entry : entries) {
+        if (json.size() > 1) json += ",";
+        json += entry.name + ":";
+        if (!entry.tensor) {
+            json += entry.value;
+            continue;
+        }
+        json += "{";
+        for (size_t i = 0; i < entry.fields.size(); i++) {
+            json += (i ? "," : "") + entry.fields[i].first + ":" + entry.fields[i].second;
+        }
+        json += "}";
+    }
+    json += "}";
+    // spaces after header are allowed, they push data section to an aligned start
+    off_t newDataStart = (sizeof(headerLength) + json.size() + tensorAlign - 1) / tensorAlign * tensorAlign;
+    json.resize(newDataStart - sizeof(headerLength), ' ');
+    headerLength = json.size();
+    file.layoutHeader.assign((char *)&headerLength, sizeof(headerLength));
+    file.layoutHeader += json;
+
+    tensorPieces.push_back({fileIndex, -1, file.offset, 0, newDataStart});
+    off_t pos = file.offset + newDataStart;
+    for (size_t i = 0; i < order.size(); i++) {
+        off_t target = file.offset + newDataStart + placed[i];
+        off_t source = dataStart + order[i]->begin;
+        off_t length = order[i]->end - order[i]->begin;
+        // padding goes with first piece so pieces cover whole file and nothing stale stays in gaps
+        off_t padding = target - pos;
+        do {
+            off_t size = min(length, (off_t)minChunkSize);
+            tensorPieces.push_back({fileIndex, source, pos, padding, padding + size});
+            pos += padding + size;
+            source += size;
+            length -= size;
+            padding = 0;
+        } while (length > 0);
+    }
+    printf("safetensors source %s: %lu tensors aligned to %ld, %ld bytes became %ld\n", file.name.c_str(),
+        order.size(), tensorAlign, (off_t)st.st_size, newDataStart + dataLength);
+    return newDataStart + dataLength;
+}
+
+// every worker copies tensor pieces before it starts on chunks, chunks covering
+// relocated files only hash and journal them so all pieces must have landed first
+void copyTensors(char *tgtBase) {
+    if (tensorPieces.empty()) return;
+    for (size_t i; (i = nextTensorPiece++) < tensorPieces.size() && !copyFailed; tensorPiecesDone++) {
+        const TensorPiece& piece = tensorPieces[i];
+        off_t bytes = dirtyBytes(piece.targetOffset, piece.targetOffset + piece.size);
+        if (bytes == 0) continue;
+        const SourceFile& file = sources[piece.file];
+        char *dst = tgtBase + piece.targetOffset;
+        faultInPages(tgtBase, piece.targetOffset, piece.targetOffset + piece.size);
+        int64_t start = nowNs();
+        if (piece.sourceOffset < 0) {
+            memcpy(dst, file.layoutHeader.data(), piece.size);
+        } else {
+            memset(dst, 0, piece.padding);
+            if (!fillFromSource(file, piece.sourceOffset, dst + piece.padding, piece.size - piece.padding, nullptr)) {
+                copyFailed = true;
+                break;
+            }
+            if (memBudget > 0) {
+                posix_fadvise(file.fd, piece.sourceOffset, piece.size - piece.padding, POSIX_FADV_DONTNEED);
+            }
+        }
+        recordFileTime(file, start, nowNs());
+        // tensor bytes were counted by reads themselves. a partly clean piece is rewritten whole but
+        // only its dirty bytes may count, update mode expects srcSize - skipSize in total
+        totalCopySize += bytes - (piece.sourceOffset < 0 ? 0 : piece.size - piece.padding);
+    }
+    while (tensorPiecesDone < tensorPieces.size() && !copyFailed) usleep(1000);
+}
+
+#ifdef HUGECP_ZSTD
+// one independent zstd frame of a compressed source, the unit one worker decompresses
+struct ZstdFrame {
+    size_t file;           // index into sources
+    off_t compressedOffset; // inside .zst file
+    off_t compressedSize;
+    off_t targetOffset;    // where its output starts inside target
+    off_t size;            // decompressed
+};
+
+static vector<ZstdFrame> zstdFrames;
+static atomic<size_t> nextFrame(0);
+static atomic<size_t> framesDone(0);
+
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER_SIZE 9
+
+bool isZstdName(const string& name) {
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".zst") == 0;
+}
+
+// seekable format keeps sizes of every frame in a skippable frame at end of file
+bool readSeekTable(int fd, off_t fileSize, vector<pair<off_t, off_t>>& table) {
+    unsigned char footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+    if (fileSize < 8 + ZSTD_SEEKABLE_FOOTER_SIZE ||
+        !preadAll(fd, footer, sizeof(footer), fileSize - sizeof(footer))) {
+        return false;
+    }
+    uint32_t frameCount, magic;
+    memcpy(&frameCount, footer, 4);
+    memcpy(&magic, footer + 5, 4);
+    if (magic != ZSTD_SEEKABLE_MAGIC) return false;
+    size_t entrySize = footer[4] & 0x80 ? 12 : 8; // optional checksum per entry
+    off_t tableSize = 8 + frameCount * entrySize + ZSTD_SEEKABLE_FOOTER_SIZE;
+    if (tableSize > fileSize) return false;
+    vector<unsigned char> entries(frameCount * entrySize);
+    if (!preadAll(fd, entries.data(), entries.size(), fileSize - tableSize + 8)) return false;
+    for (uint32_t i = 0; i < frameCount; i++) {
+        uint32_t compressed, decompressed;
+        memcpy(&compressed, &entries[i * entrySize], 4);
+        memcpy(&decompressed, &entries[i * entrySize + 4], 4);
+        table.push_back({compressed, decompressed});
+    }
+    return true;
+}
+
+// list frames of a .zst file and return its decompressed size, -1 on error.
+// seekable files give frame sizes at once, others are walked block header by block header
+off_t indexZstdFile(int fd, const string& name, size_t fileIndex, off_t targetOffset) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    off_t total = 0;
+    vector<pair<off_t, off_t>> table;
+    if (readSeekTable(fd, st.st_size, table)) {
+        off_t pos = 0;
+        for (auto& [compressed, decompressed] : table) {
+            zstdFrames.push_back({fileIndex, pos, compressed, targetOffset + total, decompressed});
+            pos += compressed;
+            total += decompressed;
+        }
+        printf("zstd source %s: %lu frames from seek table, %ld bytes decompressed\n", name.c_str(), table.size(), total);
+        return total;
+    }
+    size_t firstFrame = zstdFrames.size();
+    for (off_t pos = 0; pos < st.st_size; ) {
+        unsigned char header[ZSTD_FRAMEHEADERSIZE_MAX];
+        size_t len = min((off_t)sizeof(header), st.st_size - pos);
+        ZSTD_frameHeader frame;
+        if (!preadAll(fd, header, len, pos) || ZSTD_getFrameHeader(&frame, header, len) != 0) {
+            printf("zstd source %s has invalid frame at offset %ld\n", name.c_str(), pos);
+            return -1;
+        }
+        if (frame.frameType == ZSTD_skippableFrame) {
+            pos += frame.headerSize + frame.frameContentSize;
+            continue;
+        }
+        if (frame.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+            // without it target layout can't be known before decompressing
+            printf("zstd source %s has frame without content size at offset %ld, recompress with --content-size\n",
+                name.c_str(), pos);
+            return -1;
+        }
+        off_t end = pos + frame.headerSize;
+        for (bool last = false; !last; ) {
+            unsigned char block[3];
+            if (!preadAll(fd, block, sizeof(block), end)) {
+                printf("zstd source %s is truncated at offset %ld\n", name.c_str(), end);
+                return -1;
+            }
+            uint32_t blockHeader = block[0] | block[1] << 8 | block[2] << 16;
+            last = blockHeader & 1;
+            // rle block stores one byte whatever its size
+            end += 3 + (((blockHeader >> 1) & 3) == 1 ? 1 : blockHeader >> 3);
+        }
+        if (frame.checksumFlag) end += 4;
+        zstdFrames.push_back({fileIndex, pos, end - pos, targetOffset + total, (off_t)frame.frameContentSize});
+        total += frame.frameContentSize;
+        pos = end;
+    }
+    printf("zstd source %s: %lu frames, %ld bytes decompressed\n", name.c_str(), zstdFrames.size() - firstFrame, total);
+    return total;
+}
+
+// stream one frame from .zst file straight into its slot of target mapping
+bool decompressFrame(char *tgtBase, const ZstdFrame& frame, ZSTD_DCtx *dctx, char *in) {
+    const SourceFile& file = sources[frame.file];
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    ZSTD_outBuffer out = {tgtBase + frame.targetOffset, (size_t)frame.size, 0};
+    size_t ret = 1;
+    for (off_t pos = frame.compressedOffset, end = pos + frame.compressedSize; pos < end; ) {
+        int64_t begin = nowNs();
+        ssize_t size = pread(file.fd, in, min(end - pos, (off_t)transferSize), pos);
+        recordReadLatency(nowNs() - begin);
+        if (size == -1 && errno == EINTR) continue;
+        if (size <= 0) {
+            printf("read source file %s failed at offset %ld %s\n", file.name.c_str(), pos,
+                size == 0 ? "truncated" : strerror(errno));
+            return false;
+        }
+        ZSTD_inBuffer input = {in, (size_t)size, 0};
+        while (input.pos < input.size) {
+            ret = ZSTD_decompressStream(dctx, &out, &input);
+            if (ZSTD_isError(ret)) {
+                printf("decompress %s frame at offset %ld failed %s\n", file.name.c_str(), frame.compressedOffset,
+                    ZSTD_getErrorName(ret));
+                return false;
+            }
+            if (ret == 0 && input.pos < input.size) break; // frame ended early, caught below
+        }
+        pos += size;
+    }
+    if (ret != 0 || out.pos != out.size) {
+        printf("zstd frame of %s at offset %ld has %lu bytes, expected %ld\n", file.name.c_str(),
+            frame.compressedOffset, out.pos, frame.size);
+        return false;
+    }
+    return true;
+}
+
+// every worker helps decompressing frames before it starts on chunks, chunks covering
+// compressed files only hash and journal them so all frames must have landed first
+void decompressFrames(char *tgtBase) {
+    if (zstdFrames.empty()) return;
+    unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    // output goes straight to mapping instead of through window buffer
+    ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_stableOutBuffer, 1);
+    unique_ptr<char, decltype(&free)> in((char *)malloc(transferSize), free);
+    for (size_t i; (i = nextFrame++) < zstdFrames.size() && !copyFailed; framesDone++) {
+        const ZstdFrame& frame = zstdFrames[i];
+        off_t bytes = dirtyBytes(frame.targetOffset, frame.targetOffset + frame.size);
+        if (bytes == 0) continue;
+        const SourceFile& file = sources[frame.file];
+        faultInPages(tgtBase, frame.targetOffset, frame.targetOffset + frame.size);
+        if (memBudget > 0) {
+            posix_fadvise(file.fd, frame.compressedOffset, frame.compressedSize, POSIX_FADV_WILLNEED);
+        }
+        int64_t start = nowNs();
+        if (!decompressFrame(tgtBase, frame, dctx.get(), in.get())) {
+            copyFailed = true;
+            break;
+        }
+        recordFileTime(file, start, nowNs());
+        if (memBudget > 0) {
+            posix_fadvise(file.fd, frame.compressedOffset, frame.compressedSize, POSIX_FADV_DONTNEED);
+        }
+        totalCopySize += bytes;
+    }
+    while (framesDone < zstdFrames.size() && !copyFailed) usleep(1000);
+}
 #endif
 
-static char buffer[HUGE_PAGE_SIZE];
-static int64_t pageSize  = HUGE_PAGE_SIZE;
-static off_t srcSize = 0;
-static int64_t tgtSize = 0;
-static off_t totalCopySize = 0;
+// run worker on cpus near the memory it fills
+void pinWorker(size_t home) {
+    if (numaMode == NUMA_SPLIT) {
+        pinToNodes({chunkQueues[home].node});
+    } else if (numaMode == NUMA_BIND) {
+        pinToNodes(numaNodes);
+    }
+}
 
-void update_progress(int progress) {
-    int bar_length = 40; // Modify this to change the bar's length
-    int filled_length = (int)(bar_length * progress / 100.0);
-    char bar[bar_length + 1]; // +1 for the null terminator
-    for (int i = 0; i < bar_length; i++) {
-        if (i < filled_length) {
-            bar[i] = '=';
-        } else {
-            bar[i] = '-';
+void copyWorker(char *tgtBase, int index) {
+    size_t home = index % chunkQueues.size();
+    pinWorker(home);
+#ifdef HUGECP_ZSTD
+    decompressFrames(tgtBase);
+#endif
+    copyTensors(tgtBase);
+    if (copyFailed) return;
+    if (useIoUring) {
+        IoUring ring;
+        if (setupIoUring(ring, queueDepth)) {
+            if (!ioUringCopy(ring, tgtBase, home)) {
+                copyFailed = true;
+            }
+            closeIoUring(ring);
+            return;
         }
+        printf("io_uring is not available %s, fall back to pread\n", strerror(errno));
+    }
+    off_t begin, end;
+    while (acquireBudget(chunkSize, true)) {
+        if (!nextChunkRange(home, begin, end)) {
+            releaseBudget(chunkSize);
+            break;
+        }
+        prefetchChunk(begin, end);
+        faultInPages(tgtBase, begin, end);
+        for (off_t pos = skipCleanPages(begin, end); pos < end && !copyFailed; ) {
+            off_t runEnd = dirtyRunEnd(pos, end);
+            if (!copyRange(tgtBase, pos, runEnd)) {
+                copyFailed = true;
+            }
+            pos = skipCleanPages(runEnd, end);
+        }
+        if (copyFailed) break;
+        finishChunk(tgtBase, begin, end, true);
+        dropChunk(begin, end);
     }
-    bar[bar_length] = '\0'; // Null-terminate the string
-    printf("\r[%s] %d%%", bar, progress);
-    fflush(stdout); // Ensure output is written immediately
 }
 
-bool copyOneFile(const char *fileName, off_t fileSize, off_t pageSize, char *ptr) {
-    bool result = true;
-    int src_fd;
-    src_fd = open(fileName, O_RDONLY);
-    if (src_fd == -1) {
-        printf("source file %s cannot be opened! %s\n", fileName, strerror(errno));
-        return false;
-    }
-    int64_t pageNumber = (fileSize + pageSize - 1) / pageSize;
-    int64_t copySize = 0;
-    for (int64_t i = 0; i < pageNumber; i++) {
-        int size;
-        if ((size = read(src_fd, buffer, pageSize)) == pageSize ||
-            (size > 0 && i == pageNumber - 1)) {
-            memcpy(ptr, buffer, size);
-            ptr += pageSize; // last page no need to worry
-            copySize += size;
-            totalCopySize += size;
-            update_progress(totalCopySize * 100 / tgtSize);
-        } else {
-            if (size == -1) {
-                printf("read source file %s failed with error %s\n", fileName, strerror(errno));
-                result = false;
-                break;
-            } else {
-                // this is complicated situation, it require you to do a repeating call
-                // let's do it later
-                printf("returned reading number is not expected as %lu", pageSize);
-                result = false;
-                break;
+// --prefault: allocate and zero target pages on many cores before any data arrives,
+// zeroing 1G pages is otherwise paid serially inside the first write to each page
+void prefaultWorker(char *tgtBase, int index) {
+    size_t home = index % chunkQueues.size();
+    pinWorker(home);
+    bool populate = true;
+    off_t begin, end;
+    while (nextChunkRange(home, begin, end)) {
+        // last chunk stops at end of data, its page still has to be faulted
+        end = min((end + pageSize - 1) / pageSize * pageSize, (off_t)tgtSize);
+        for (off_t pos = skipCleanPages(begin, end); pos < end; ) {
+            off_t runEnd = dirtyRunEnd(pos, end);
+            if (populate && madvise(tgtBase + pos, runEnd - pos, MADV_POPULATE_WRITE) != 0) {
+                if (errno != EINVAL) {
+                    printf("prefault target failed %s\n", strerror(errno));
+                    copyFailed = true;
+                    return;
+                }
+                // kernel before 5.14, touch every page instead
+                populate = false;
             }
+            for (off_t page = pos; !populate && page < runEnd; page += pageSize) {
+                volatile char *p = tgtBase + page;
+                *p = *p;
+            }
+            prefaultPages += (runEnd - pos) / pageSize;
+            pos = skipCleanPages(runEnd, end);
         }
     }
-    // printf("file %s size %lu copied %lu %s\n", fileName, fileSize, copySize, result?"success":"failure");
-    return result;
 }
 
 bool openDirectory(const string& dirName, map<string, off_t>& filesInfo, off_t& totalSize) {
@@ -112,16 +1859,532 @@ bool openDirectory(const string& dirName, map<string, off_t>& filesInfo, off_t&
     return result;
 }
 
+// huge page size comes from target's hugetlbfs mount, so one binary serves 2M and 1G mounts
+// (or both on one host). target may not exist yet, then its directory tells
+bool detectPageSize(const char *tgtName, int64_t requested) {
+    struct statfs fs;
+    string path = tgtName;
+    if (statfs(path.c_str(), &fs) != 0) {
+        size_t slash = path.rfind('/');
+        path = slash == string::npos ? "." : path.substr(0, slash + 1);
+        if (statfs(path.c_str(), &fs) != 0) {
+            printf("statfs target %s failed %s\n", tgtName, strerror(errno));
+            return false;
+        }
+    }
+    tgtHugetlbfs = fs.f_type == HUGETLBFS_MAGIC;
+    if (!tgtHugetlbfs) {
+        pageSize = requested ? requested : DEFAULT_PAGE_SIZE;
+        printf("target %s is not on hugetlbfs, copy to a plain file in units of %ld bytes\n", tgtName, pageSize);
+        return true;
+    }
+    if (requested && requested != (int64_t)fs.f_bsize) {
+        printf("--page-size %ld doesn't match page size %ld of hugetlbfs mount of %s\n", requested,
+            (int64_t)fs.f_bsize, tgtName);
+        return false;
+    }
+    pageSize = fs.f_bsize;
+    printf("target %s is on hugetlbfs with page size %ld\n", tgtName, pageSize);
+    return true;
+}
+
+// chunk is at least one page and always whole pages
+void setChunkSize() {
+    chunkSize = (max(pageSize, minChunkSize) + pageSize - 1) / pageSize * pageSize;
+}
+
+// open every source file and lay them out inside target, returns exit code on failure
+int collectSources(const char *srcName) {
+    struct stat st;
+
+    if (stat(srcName, &st) != 0) {
+        printf("source file %s is not valid file: %s\n", srcName, strerror(errno));
+        return -2;
+    }
+    map<string, off_t> filesInfo;
+    if (S_ISREG(st.st_mode)) {
+        printf("copy mode for single model file %s\n", srcName);
+        srcSize = st.st_size;
+        filesInfo.insert(make_pair(srcName, st.st_size));
+    } else if (S_ISDIR(st.st_mode)) {
+        printf("copy mode for directory model file %s\n", srcName);
+        if (!openDirectory(srcName, filesInfo, srcSize)) {
+            printf("collect source directory files info failed!\n");
+            return -6;
+        }
+    }
+    // we have to assume all model files's name must be alphabetical ordered
+    off_t offset = 0;
+    for (auto it = filesInfo.begin(); it != filesInfo.end(); it ++) {
+        int fd = open(it->first.c_str(), O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            printf("source file %s cannot be opened! %s\n", it->first.c_str(), strerror(errno));
+            return -3;
+        }
+        if (alignFiles) {
+            // every file starts at page boundary so it can be mapped on its own
+            offset = (offset + pageSize - 1) / pageSize * pageSize;
+        }
+        bool relocate = tensorAlign > 0 && isSafetensorsName(it->first);
+        if (relocate) {
+            offset = (offset + tensorAlign - 1) / tensorAlign * tensorAlign;
+        }
+        SourceFile file = {it->first, it->second, offset, fd, st.st_mtim, {}, 0, false, -1, false, {}};
+#ifdef HUGECP_ZSTD
+        if (isZstdName(it->first)) {
+            file.compressed = true;
+            file.size = indexZstdFile(fd, it->first, sources.size(), offset);
+            if (file.size < 0) {
+                return -3;
+            }
+            srcSize += file.size - it->second;
+        }
+#endif
+        if (relocate) {
+            file.size = layoutSafetensors(file, sources.size());
+            if (file.size < 0) {
+                return -3;
+            }
+            srcSize += file.size - it->second;
+        }
+        if (memBudget > 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        if (useDirect && !filledUpFront(file) && file.size >= DIRECT_IO_ALIGN) {
+            // O_DIRECT lands at offset inside target, which has to be block aligned too
+            if (offset % DIRECT_IO_ALIGN != 0) {
+                printf("source file %s is not block aligned inside target, read through page cache (use --align)\n",
+                    it->first.c_str());
+            } else if ((file.directFd = open(it->first.c_str(), O_RDONLY | O_DIRECT)) == -1) {
+                printf("source file %s cannot be opened with O_DIRECT %s, read through page cache\n",
+                    it->first.c_str(), strerror(errno));
+            }
+        }
+        if (computeChecksum && file.size > 0) {
+            file.pageCrc.resize((offset + file.size - 1) / pageSize - offset / pageSize + 1);
+        }
+        sources.push_back(file);
+        offset += file.size;
+    }
+    dataSize = offset;
+    // target size for mmap must be aligned with pageSize;
+    tgtSize = (dataSize + pageSize - 1) / pageSize * pageSize;
+    return 0;
+}
+
+void closeSources() {
+    for (auto& file : sources) {
+        if (file.fd != -1) close(file.fd);
+        if (file.directFd != -1) close(file.directFd);
+    }
+}
+
+void verifyWorker(char *tgtBase, int index, bool useManifest) {
+    size_t home = index % chunkQueues.size();
+    vector<char> buffer(useManifest ? 0 : INLINE_HASH_SIZE);
+    off_t begin, end;
+    while (nextChunkRange(home, begin, end)) {
+        if (useManifest) {
+            // re-hash every page into pages[], compared against manifest afterwards
+            finishChunk(tgtBase, begin, end, false);
+            totalCopySize += end - begin;
+        }
+        for (auto it = findSource(begin); !useManifest && it != sources.end() && it->offset < end; it++) {
+            off_t from = max(begin, it->offset);
+            off_t to = min(end, it->offset + it->size);
+            for (; from < to; from += buffer.size()) {
+                off_t len = min(to - from, (off_t)buffer.size());
+                if (!readFully(*it, from - it->offset, buffer.data(), len)) {
+                    copyFailed = true;
+                    return;
+                }
+                if (memcmp(buffer.data(), tgtBase + from, len) != 0) {
+                    printf("\ntarget differs from source file %s around offset %lu\n", it->name.c_str(),
+                        from - it->offset);
+                    verifyMismatch++;
+                }
+            }
+        }
+    }
+}
+
+// --verify: re-hash target in parallel and compare with manifest, or read source again and compare bytes
+bool verifyTarget(const char *srcName, const char *tgtName, const char *manifestPath, int threadNumber,
+    int64_t requestedPageSize) {
+    OldManifest old;
+    bool useManifest = manifestPath != nullptr;
+    if (useManifest) {
+        if (!loadManifest(manifestPath, old)) return false;
+        if (!old.header.complete) {
+            printf("manifest %s belongs to an unfinished copy, unfinished pages will be reported\n", manifestPath);
+        }
+        pageSize = old.header.pageSize;
+        alignFiles = old.header.alignment != 0;
+        tensorAlign = old.header.tensorAlignment;
+        if (srcName) {
+            // only check sources didn't change since copy, contents are checked by page crc
+            if (collectSources(srcName) != 0) return false;
+            bool same = sources.size() == old.entries.size();
+            for (size_t i = 0; same && i < sources.size(); i++) {
+                same = old.names[i] == manifestName(sources[i]) && old.entries[i].length == (uint64_t)sources[i].size &&
+                    old.entries[i].mtimeSec == sources[i].mtime.tv_sec && old.entries[i].mtimeNsec == sources[i].mtime.tv_nsec;
+            }
+            if (!same) {
+                printf("source %s changed since target was copied\n", srcName);
+                verifyMismatch++;
+            }
+            closeSources();
+            sources.clear();
+        }
+        // layout comes from manifest, no source is read
+        srcSize = dataSize = 0;
+        for (size_t i = 0; i < old.entries.size(); i++) {
+            const ManifestEntry& entry = old.entries[i];
+            SourceFile file = {old.names[i], (off_t)entry.length, (off_t)entry.offset, -1,
+                {entry.mtimeSec, entry.mtimeNsec}, {}, 0, false, -1, false, {}};
+            if (file.size > 0) {
+                file.pageCrc.resize((file.offset + file.size - 1) / pageSize - file.offset / pageSize + 1);
+            }
+            sources.push_back(file);
+            srcSize += file.size;
+            dataSize = max(dataSize, file.offset + file.size);
+        }
+        tgtSize = old.header.targetSize;
+        computeChecksum = true;
+        pages.assign(tgtSize / pageSize, {0, PAGE_MISSING});
+    } else {
+        if (!srcName) {
+            fprintf(stderr, "Error: --verify requires -i source or --manifest.\n");
+            return false;
+        }
+        if (!detectPageSize(tgtName, requestedPageSize) || collectSources(srcName) != 0) return false;
+        for (auto& file : sources) {
+            if (filledUpFront(file)) {
+                fprintf(stderr, "Error: compressed or relocated source %s can't be compared byte by byte, use --manifest.\n",
+                    file.name.c_str());
+                return false;
+            }
+        }
+    }
+
+    int tgtFd = open(tgtName, O_RDONLY);
+    if (tgtFd == -1 || fstat(tgtFd, &tgtStat) != 0) {
+        printf("target file %s cannot be opened! %s\n", tgtName, strerror(errno));
+        return false;
+    }
+    if (tgtStat.st_size < dataSize) {
+        printf("target file %s size %lu is smaller than expected %lu\n", tgtName, tgtStat.st_size, dataSize);
+        close(tgtFd);
+        return false;
+    }
+    void *ptr = mmap(NULL, tgtSize, PROT_READ, MAP_SHARED, tgtFd, 0);
+    close(tgtFd);
+    if (ptr == MAP_FAILED) {
+        printf("mmap target file %s failed %s\n", tgtName, strerror(errno));
+        return false;
+    }
+    char *tgtPtr = (char *)ptr;
+    setChunkSize();
+    if (!setupNumaPlacement(tgtPtr)) {
+        munmap(ptr, tgtSize);
+        return false;
+    }
+    printf("verify target %s against %s with %d thread(s)\n", tgtName, useManifest ? "manifest" : "source", threadNumber);
+    vector<thread> workers;
+    startNs = nowNs();
+    runningWorkers = threadNumber;
+    for (int i = 0; i < threadNumber; i++) {
+        workers.emplace_back([=] {
+            verifyWorker(tgtPtr, i, useManifest);
+            runningWorkers--;
+        });
+    }
+    monitorWorkers(workers, useManifest ? dataSize : srcSize);
+    printf("\n");
+    if (useManifest && !copyFailed) {
+        for (size_t page = 0; page < pages.size(); page++) {
+            if (page >= old.pages.size() || old.pages[page].state != PAGE_WRITTEN) {
+                printf("page %lu was never finished by copy\n", page);
+                verifyMismatch++;
+            } else if (old.pages[page].crc32c != pages[page].crc32c) {
+                printf("page %lu checksum mismatch, expected %08x got %08x\n", page, old.pages[page].crc32c,
+                    pages[page].crc32c);
+                verifyMismatch++;
+            }
+        }
+        combineFileCrc(tgtPtr);
+        for (size_t i = 0; old.header.complete && i < sources.size(); i++) {
+            if (sources[i].crc != old.entries[i].crc32c) {
+                printf("file %s checksum mismatch, expected %08x got %08x\n", sources[i].name.c_str(),
+                    old.entries[i].crc32c, sources[i].crc);
+                verifyMismatch++;
+            }
+        }
+    }
+    closeSources();
+    munmap(ptr, tgtSize);
+    bool result = !copyFailed && verifyMismatch == 0;
+    printf("%s verify of target %s, %ld mismatch(es)\n", result ? "Succeed" : "Failed", tgtName, verifyMismatch.load());
+    return result;
+}
+
+// resident model manager: state file remembers every model copied into hugetlbfs, its size and
+// last use, so a page budget can be kept by evicting least recently used models
+struct ResidentModel {
+    string target;
+    string source;
+    int64_t size;        // target size, that many bytes of huge pages are held
+    int64_t sourceSize;
+    int64_t sourceMtime; // newest mtime of source files, tells whether source changed since copy
+    int64_t lastUse;     // unix seconds
+    int pid;             // copying process while loading, 0 once resident, -1 copy never finished
+};
+
+// default state lives in home directory, hugetlbfs doesn't support write()
+string defaultStatePath() {
+    const char *home = getenv("HOME");
+    return string(home && *home ? home : "/var/tmp") + "/.hugecp.state";
+}
+
+string absolutePath(const char *name) {
+    if (name[0] == '/') return name;
+    char cwd[4096];
+    return getcwd(cwd, sizeof(cwd)) ? string(cwd) + "/" + name : string(name);
+}
+
+// open and exclusively lock state file, every reader and writer holds lock for its whole update
+int lockState(const string& path) {
+    int fd = open(path.c_str(), O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        printf("state file %s cannot be opened! %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            printf("lock state file %s failed %s\n", path.c_str(), strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// one tab separated line per model, entries whose target is gone are dropped
+vector<ResidentModel> readState(int fd) {
+    vector<ResidentModel> models;
+    string text;
+    char buf[65536];
+    ssize_t size;
+    for (off_t pos = 0; (size = pread(fd, buf, sizeof(buf), pos)) > 0; pos += size) text.append(buf, size);
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = text.find('\n', begin);
+        if (end == string::npos) end = text.size();
+        string line = text.substr(begin, end - begin);
+        begin = end + 1;
+        size_t tab1 = line.find('\t');
+        size_t tab2 = tab1 == string::npos ? tab1 : line.find('\t', tab1 + 1);
+        if (tab2 == string::npos) continue;
+        ResidentModel model = {line.substr(0, tab1), line.substr(tab1 + 1, tab2 - tab1 - 1), 0, 0, 0, 0, 0};
+        if (sscanf(line.c_str() + tab2 + 1, "%ld %ld %ld %ld %d", &model.size, &model.sourceSize,
+                &model.sourceMtime, &model.lastUse, &model.pid) != 5) {
+            continue;
+        }
+        if (access(model.target.c_str(), F_OK) != 0) continue;
+        if (model.pid > 0 && kill(model.pid, 0) != 0 && errno == ESRCH) {
+            // loader died, partial target still holds pages
+            model.pid = -1;
+        }
+        models.push_back(model);
+    }
+    return models;
+}
+
+bool writeState(int fd, const vector<ResidentModel>& models) {
+    string text;
+    char line[256];
+    for (auto& model : models) {
+        snprintf(line, sizeof(line), "\t%ld %ld %ld %ld %d\n", model.size, model.sourceSize, model.sourceMtime,
+            model.lastUse, model.pid);
+        text += model.target + "\t" + model.source + line;
+    }
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, text.data(), text.size(), 0) != (ssize_t)text.size()) {
+        printf("write state file failed %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+vector<ResidentModel>::iterator findModel(vector<ResidentModel>& models, const string& target) {
+    return find_if(models.begin(), models.end(), [&](const ResidentModel& model) { return model.target == target; });
+}
+
+void listModels(const vector<ResidentModel>& models) {
+    int64_t total = 0;
+    printf("%-12s %14s %-20s %s\n", "STATE", "SIZE", "LAST USE", "TARGET <- SOURCE");
+    for (auto& model : models) {
+        char when[32];
+        time_t lastUse = model.lastUse;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&lastUse));
+        printf("%-12s %14ld %-20s %s <- %s\n", model.pid == 0 ? "resident" : model.pid > 0 ? "loading" : "incomplete",
+            model.size, when, model.target.c_str(), model.source.c_str());
+        total += model.size;
+    }
+    printf("%lu model(s), %ld bytes of huge pages\n", models.size(), total);
+}
+
+bool evictModel(vector<ResidentModel>& models, vector<ResidentModel>::iterator it) {
+    if (it->pid > 0) {
+        printf("model %s is still being loaded by pid %d\n", it->target.c_str(), it->pid);
+        return false;
+    }
+    // pages of a file some process still maps are only freed once it unmaps
+    if (unlink(it->target.c_str()) != 0 && errno != ENOENT) {
+        printf("evict model %s failed %s\n", it->target.c_str(), strerror(errno));
+        return false;
+    }
+    printf("evicted model %s, %ld bytes, last used %ld seconds ago\n", it->target.c_str(), it->size,
+        (int64_t)time(NULL) - it->lastUse);
+    models.erase(it);
+    return true;
+}
+
+// free bytes of huge pages of size target's hugetlbfs mount uses, -1 when target is elsewhere
+int64_t targetFreeBytes(const string& target) {
+    struct statfs fs;
+    string dir = target.substr(0, target.rfind('/') + 1);
+    if (statfs(dir.c_str(), &fs) != 0 || fs.f_type != HUGETLBFS_MAGIC) return -1;
+    int64_t free = freeHugePages(fs.f_bsize, vector<int>());
+    return free < 0 ? -1 : free * (int64_t)fs.f_bsize;
+}
+
+// evict least recently used models, unfinished copies first, until target of given size
+// fits into budget and into free huge pages
+bool makeRoom(vector<ResidentModel>& models, const string& target, int64_t needed, int64_t budget) {
+    while (true) {
+        int64_t used = 0;
+        for (auto& model : models) {
+            if (model.target != target) used += model.size;
+        }
+        int64_t free = targetFreeBytes(target);
+        bool fits = used + needed <= budget && (free < 0 || free >= needed);
+        if (fits) return true;
+        auto victim = models.end();
+        for (auto it = models.begin(); it != models.end(); it++) {
+            if (it->target == target || it->pid > 0) continue;
+            if (victim == models.end() || (it->pid < 0) > (victim->pid < 0) ||
+                ((it->pid < 0) == (victim->pid < 0) && it->lastUse < victim->lastUse)) {
+                victim = it;
+            }
+        }
+        if (victim == models.end()) {
+            printf("cannot make room for %ld bytes: %ld of budget %ld used by models still loading\n", needed, used,
+                budget);
+            return false;
+        }
+        if (!evictModel(models, victim)) return false;
+    }
+}
+
+// update mode reuses whatever previous copy left in target, -1 when it can't be opened
+int openTarget(const char *tgtNamePtr, bool updateMode) {
+    int tgtFd = open(tgtNamePtr, O_CREAT | O_RDWR | (updateMode ? 0 : O_EXCL), 0666);
+    if (tgtFd == -1 || fstat(tgtFd, &tgtStat) != 0) {
+        printf("target file %s cannot be opened! %s\n", tgtNamePtr, strerror(errno));
+        if (tgtFd != -1) close(tgtFd);
+        return -1;
+    }
+    return tgtFd;
+}
+
+// records how copy of a registered model ended, a failed copy stays as incomplete,
+// first to go when room is needed
+void finishModel(const string& statePath, const string& tgtPath, bool result) {
+    int stateFd = lockState(statePath);
+    if (stateFd == -1) return;
+    vector<ResidentModel> models = readState(stateFd);
+    auto it = findModel(models, tgtPath);
+    if (it != models.end()) {
+        it->pid = result ? 0 : -1;
+        it->lastUse = time(NULL);
+    }
+    writeState(stateFd, models);
+    close(stateFd);
+}
+
+// newest mtime of all source files
+int64_t sourceMtime() {
+    int64_t mtime = 0;
+    for (auto& file : sources) mtime = max(mtime, (int64_t)file.mtime.tv_sec);
+    return mtime;
+}
+
+// long options without a short letter
+enum {
+    OPT_IO_URING = 256,
+    OPT_QUEUE_DEPTH,
+    OPT_NUMA,
+    OPT_MANIFEST,
+    OPT_ALIGN,
+    OPT_UPDATE,
+    OPT_VERIFY,
+    OPT_COPY_KERNEL,
+    OPT_STATS_JSON,
+    OPT_PREFAULT,
+    OPT_MEM_BUDGET,
+    OPT_DIRECT,
+    OPT_STATE,
+    OPT_BUDGET,
+    OPT_LIST,
+    OPT_EVICT,
+    OPT_USE,
+    OPT_PRELOAD,
+    OPT_PAGE_SIZE,
+    OPT_CHUNK_SIZE,
+    OPT_BUFFER_SIZE,
+    OPT_TENSOR_ALIGN,
+};
+
 int main(int argc, char **argv) {
     bool verbose_flag = false;
     struct option long_options[] = {
         {"verbose", no_argument, 0, 'v'},
         {"source", required_argument, 0, 'i'},
         {"target", required_argument, 0, 'o'},
+        {"threads", required_argument, 0, 't'},
+        {"io-uring", no_argument, 0, OPT_IO_URING},
+        {"queue-depth", required_argument, 0, OPT_QUEUE_DEPTH},
+        {"numa", required_argument, 0, OPT_NUMA},
+        {"manifest", required_argument, 0, OPT_MANIFEST},
+        {"align", no_argument, 0, OPT_ALIGN},
+        {"update", no_argument, 0, OPT_UPDATE},
+        {"verify", no_argument, 0, OPT_VERIFY},
+        {"copy-kernel", required_argument, 0, OPT_COPY_KERNEL},
+        {"stats-json", required_argument, 0, OPT_STATS_JSON},
+        {"prefault", optional_argument, 0, OPT_PREFAULT},
+        {"mem-budget", required_argument, 0, OPT_MEM_BUDGET},
+        {"direct", no_argument, 0, OPT_DIRECT},
+        {"state", required_argument, 0, OPT_STATE},
+        {"budget", required_argument, 0, OPT_BUDGET},
+        {"list", no_argument, 0, OPT_LIST},
+        {"evict", required_argument, 0, OPT_EVICT},
+        {"use", required_argument, 0, OPT_USE},
+        {"preload", no_argument, 0, OPT_PRELOAD},
+        {"page-size", required_argument, 0, OPT_PAGE_SIZE},
+        {"chunk-size", required_argument, 0, OPT_CHUNK_SIZE},
+        {"buffer-size", required_argument, 0, OPT_BUFFER_SIZE},
+        {"tensor-align", required_argument, 0, OPT_TENSOR_ALIGN},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0} // Required terminator
     };
-    const char* help = "[--verbose] <-i sourceFilename|sourceDirectory > <-o targetFilename> [--help]";
+    const char* help = "[--verbose] <-i sourceFilename|sourceDirectory > <-o targetFilename> [--threads N]\n"
+        "    [--io-uring [--queue-depth N]] [--numa interleave|bind=<nodes>|split[=<nodes>]]\n"
+        "    [--manifest manifestFilename [--update]] [--align] [--copy-kernel direct|memcpy|sse2|avx2|avx512|auto]\n"
+        "    [--stats-json statsFilename] [--prefault[=threads]] [--mem-budget size[K|M|G]] [--direct] [--help]\n"
+        "    [--state stateFilename] [--budget size[K|M|G]] [--preload]\n"
+        "    [--page-size size] [--chunk-size size] [--buffer-size size] [--tensor-align size]\n"
+        "    --verify <-o targetFilename> <--manifest manifestFilename|-i sourceFilename|sourceDirectory> [--threads N]\n"
+        "    [--state stateFilename] --list | --evict targetFilename | --use targetFilename";
 
      // Check for no arguments or just program name
      if (argc <= 1) {
@@ -129,10 +2392,18 @@ int main(int argc, char **argv) {
         printf("Usage: %s %s\n", argv[0], help);
         return 1;
     }
-    char* srcNamePtr = nullptr, *tgtNamePtr = nullptr;
+    char* srcNamePtr = nullptr, *tgtNamePtr = nullptr, *manifestNamePtr = nullptr, *statsNamePtr = nullptr;
+    int threadNumber = 1;
+    bool updateMode = false, verifyMode = false;
+    int prefaultThreads = 0;
+    // resident model manager, state file is only touched when one of its options is given
+    char *statePathPtr = nullptr, *evictNamePtr = nullptr, *useNamePtr = nullptr;
+    int64_t budget = 0;
+    bool listMode = false, preload = false;
+    int64_t requestedPageSize = 0;
     int option_index = 0;
     int opt;
-    while ((opt = getopt_long(argc, argv, "hvo:i:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvo:i:t:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'v':
                 verbose_flag = true;
@@ -143,6 +2414,141 @@ int main(int argc, char **argv) {
             case 'o':
                 tgtNamePtr = optarg;
                 break;
+            case 't':
+                threadNumber = atoi(optarg);
+                if (threadNumber < 1) {
+                    fprintf(stderr, "Error: --threads requires a positive number.\n");
+                    return 1;
+                }
+                break;
+            case OPT_IO_URING:
+                useIoUring = true;
+                break;
+            case OPT_QUEUE_DEPTH:
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "Error: --queue-depth requires a positive number.\n");
+                    return 1;
+                }
+                queueDepth = atoi(optarg);
+                break;
+            case OPT_MANIFEST:
+                manifestNamePtr = optarg;
+                computeChecksum = true;
+                break;
+            case OPT_ALIGN:
+                alignFiles = true;
+                break;
+            case OPT_UPDATE:
+                updateMode = true;
+                break;
+            case OPT_VERIFY:
+                verifyMode = true;
+                break;
+            case OPT_COPY_KERNEL:
+                copyKernel = parseCopyKernel(optarg);
+                if (copyKernel == COPY_KERNEL_COUNT || !copyKernelSupported(copyKernel)) {
+                    fprintf(stderr, "Error: copy kernel %s is unknown or not supported by this cpu.\n", optarg);
+                    return 1;
+                }
+                copyFunc = copyKernelFunc(copyKernel);
+                break;
+            case OPT_STATS_JSON:
+                statsNamePtr = optarg;
+                break;
+            case OPT_MEM_BUDGET:
+                if ((memBudget = parseSize(optarg)) <= 0) {
+                    fprintf(stderr, "Error: invalid --mem-budget %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_DIRECT:
+                useDirect = true;
+                break;
+            case OPT_STATE:
+                statePathPtr = optarg;
+                break;
+            case OPT_BUDGET:
+                if ((budget = parseSize(optarg)) <= 0) {
+                    fprintf(stderr, "Error: invalid --budget %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_LIST:
+                listMode = true;
+                break;
+            case OPT_EVICT:
+                evictNamePtr = optarg;
+                break;
+            case OPT_USE:
+                useNamePtr = optarg;
+                break;
+            case OPT_PRELOAD:
+                preload = true;
+                break;
+            case OPT_PAGE_SIZE:
+                // only for targets outside hugetlbfs, hugetlbfs mount dictates its own
+                requestedPageSize = parseSize(optarg);
+                if (requestedPageSize <= 0 || (requestedPageSize & (requestedPageSize - 1)) != 0) {
+                    fprintf(stderr, "Error: --page-size requires a power of two.\n");
+                    return 1;
+                }
+                break;
+            case OPT_CHUNK_SIZE:
+                if ((minChunkSize = parseSize(optarg)) <= 0) {
+                    fprintf(stderr, "Error: invalid --chunk-size %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_BUFFER_SIZE:
+                transferSize = parseSize(optarg);
+                if (transferSize < DIRECT_IO_ALIGN || transferSize > (1 << 30)) {
+                    fprintf(stderr, "Error: --buffer-size must be between 4K and 1G.\n");
+                    return 1;
+                }
+                // keep O_DIRECT reads into bounce buffer block aligned
+                transferSize = (transferSize + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+                break;
+            case OPT_TENSOR_ALIGN:
+                tensorAlign = parseSize(optarg);
+                if (tensorAlign < 8 || tensorAlign > (1 << 30) || (tensorAlign & (tensorAlign - 1)) != 0) {
+                    fprintf(stderr, "Error: --tensor-align must be a power of two between 8 and 1G.\n");
+                    return 1;
+                }
+                break;
+            case OPT_PREFAULT:
+                // zeroing is bound by memory bandwidth, use every cpu unless told otherwise
+                prefaultThreads = optarg ? atoi(optarg) : max(1U, thread::hardware_concurrency());
+                if (prefaultThreads < 1) {
+                    fprintf(stderr, "Error: --prefault requires a positive number of threads.\n");
+                    return 1;
+                }
+                break;
+            case OPT_NUMA:
+                if (strcmp(optarg, "interleave") == 0 || strncmp(optarg, "interleave=", 11) == 0) {
+                    numaMode = NUMA_INTERLEAVE;
+                } else if (strncmp(optarg, "bind=", 5) == 0) {
+                    numaMode = NUMA_BIND;
+                } else if (strcmp(optarg, "split") == 0 || strncmp(optarg, "split=", 6) == 0) {
+                    numaMode = NUMA_SPLIT;
+                } else {
+                    fprintf(stderr, "Error: unknown --numa mode %s.\n", optarg);
+                    return 1;
+                }
+                {
+                    // without explicit list use every online node
+                    const char *list = strchr(optarg, '=');
+                    char line[4096];
+                    if (list == nullptr && readSysfsLine("/sys/devices/system/node/online", line, sizeof(line))) {
+                        list = line;
+                    } else if (list != nullptr) {
+                        list++;
+                    }
+                    if (list == nullptr || !parseNodeList(list, numaNodes)) {
+                        fprintf(stderr, "Error: invalid numa node list for --numa %s.\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
             case 'h':
                 printf("Usage: %s %s\n", argv[0], help);
                 return 0;
@@ -154,58 +2560,287 @@ int main(int argc, char **argv) {
         }
     }
 
-    struct stat st;
+    string statePath = statePathPtr ? statePathPtr : defaultStatePath();
+    if (listMode || evictNamePtr || useNamePtr) {
+        int stateFd = lockState(statePath);
+        if (stateFd == -1) {
+            return -13;
+        }
+        vector<ResidentModel> models = readState(stateFd);
+        bool ok = true;
+        if (evictNamePtr) {
+            auto it = findModel(models, absolutePath(evictNamePtr));
+            if (it == models.end()) {
+                printf("model %s is not resident\n", evictNamePtr);
+                ok = false;
+            } else {
+                ok = evictModel(models, it);
+            }
+        }
+        if (useNamePtr) {
+            // inference side tells us it switched to this model
+            auto it = findModel(models, absolutePath(useNamePtr));
+            if (it == models.end()) {
+                printf("model %s is not resident\n", useNamePtr);
+                ok = false;
+            } else {
+                it->lastUse = time(NULL);
+            }
+        }
+        if (listMode) {
+            listModels(models);
+        }
+        ok = writeState(stateFd, models) && ok;
+        close(stateFd);
+        return ok ? 0 : -13;
+    }
+    bool manageModels = statePathPtr || budget > 0 || preload;
 
-    if (stat(srcNamePtr, &st) != 0) {
-        printf("source file %s is not valid file: %s\n", srcNamePtr, strerror(errno));
-        return -2;
+    if (computeChecksum || verifyMode) {
+        initCrc32c();
     }
-    map<string, off_t> filesInfo;
-    if (S_ISREG(st.st_mode)) {
-        printf("copy mode for single model file %s\n", srcNamePtr);
-        srcSize = st.st_size;
-        filesInfo.insert(make_pair(srcNamePtr, st.st_size));
-    } else if (S_ISDIR(st.st_mode)) {
-        printf("copy mode for directory model file %s\n", srcNamePtr);
-        if (!openDirectory(srcNamePtr, filesInfo, srcSize)) {
-            printf("collect source directory files info failed!\n");
+    if (verifyMode) {
+        return verifyTarget(srcNamePtr, tgtNamePtr, manifestNamePtr, threadNumber, requestedPageSize) ? 0 : -10;
+    }
+    if (!detectPageSize(tgtNamePtr, requestedPageSize)) {
+        return -6;
+    }
+    int ret = collectSources(srcNamePtr);
+    if (ret != 0) {
+        return ret;
+    }
+    if (updateMode && !manifestNamePtr) {
+        fprintf(stderr, "Error: --update requires --manifest of previous copy.\n");
+        return 1;
+    }
+    string tgtPath = absolutePath(tgtNamePtr);
+    int tgtFd = -1;
+    if (manageModels) {
+        int stateFd = lockState(statePath);
+        if (stateFd == -1) {
+            return -13;
+        }
+        vector<ResidentModel> models = readState(stateFd);
+        string srcPath = absolutePath(srcNamePtr);
+        auto it = findModel(models, tgtPath);
+        if (it != models.end() && it->pid == 0 && it->source == srcPath && it->sourceSize == srcSize &&
+            it->sourceMtime == sourceMtime()) {
+            // model switch to a resident model costs nothing
+            it->lastUse = time(NULL);
+            writeState(stateFd, models);
+            close(stateFd);
+            printf("model %s is already resident in %s\n", srcNamePtr, tgtNamePtr);
+            return 0;
+        }
+        if (it != models.end() && it->pid > 0) {
+            printf("model %s is already being loaded by pid %d\n", tgtNamePtr, it->pid);
+            close(stateFd);
+            return -13;
+        }
+        if (it != models.end() && !updateMode) {
+            // incomplete copy or stale source, start over from an empty target
+            printf("reloading model %s, previous copy is %s\n", tgtNamePtr,
+                it->pid < 0 ? "incomplete" : "out of date");
+            if (unlink(tgtPath.c_str()) != 0 && errno != ENOENT) {
+                printf("remove old target %s failed %s\n", tgtNamePtr, strerror(errno));
+                close(stateFd);
+                return -6;
+            }
+            models.erase(it);
+        }
+        // target is opened before it is registered, so state never lists a copy that couldn't start
+        tgtFd = openTarget(tgtNamePtr, updateMode);
+        if (tgtFd == -1) {
+            writeState(stateFd, models);
+            close(stateFd);
             return -6;
         }
+        if (budget > 0 && !makeRoom(models, tgtPath, tgtSize, budget)) {
+            writeState(stateFd, models);
+            close(stateFd);
+            close(tgtFd);
+            unlink(tgtNamePtr);
+            return -13;
+        }
+        int pid = getpid();
+        if (preload) {
+            // parent registers child and returns, child copies with nobody watching its output
+            fflush(stdout);
+            pid = fork();
+            if (pid == -1) {
+                printf("fork preload process failed %s\n", strerror(errno));
+                writeState(stateFd, models);
+                close(stateFd);
+                close(tgtFd);
+                unlink(tgtNamePtr);
+                return -13;
+            }
+            if (pid == 0) {
+                // keep lock to parent, it still writes state
+                close(stateFd);
+                setsid();
+                int devNull = open("/dev/null", O_RDWR);
+                dup2(devNull, STDIN_FILENO);
+                dup2(devNull, STDOUT_FILENO);
+                dup2(devNull, STDERR_FILENO);
+                close(devNull);
+            }
+        }
+        if (pid != 0) {
+            it = findModel(models, tgtPath);
+            if (it != models.end()) models.erase(it);
+            models.push_back({tgtPath, srcPath, tgtSize, srcSize, sourceMtime(), time(NULL), pid});
+            bool ok = writeState(stateFd, models);
+            close(stateFd);
+            if (!ok) {
+                return -13;
+            }
+            if (preload) {
+                printf("preloading %s into %s in background, pid %d\n", srcNamePtr, tgtNamePtr, pid);
+                close(tgtFd);
+                return 0;
+            }
+        }
     }
-    // target size for mmap must be aligned with pageSize;
-    tgtSize = (srcSize + pageSize - 1) / pageSize * pageSize;
-    int tgtFd;  
-    tgtFd = open(tgtNamePtr, O_CREAT | O_RDWR | O_EXCL, 0666);
-    if (tgtFd == -1) {
-        printf("target file %s cannot be opened! %s\n", tgtNamePtr, strerror(errno));
-        return -6;
+    if (!manageModels) {
+        tgtFd = openTarget(tgtNamePtr, updateMode);
+        if (tgtFd == -1) {
+            return -6;
+        }
+    }
+    // a registered model whose copy stops here is left as incomplete, a target created by this
+    // run alone is removed so O_EXCL doesn't block the next one
+    auto failCopy = [&](int code) {
+        if (manageModels) {
+            finishModel(statePath, tgtPath, false);
+        } else if (!updateMode) {
+            unlink(tgtNamePtr);
+        }
+        return code;
+    };
+    off_t skipSize = 0;
+    if (computeChecksum) {
+        pages.assign(tgtSize / pageSize, {0, PAGE_MISSING});
+    }
+    if (updateMode) {
+        OldManifest old;
+        if (access(manifestNamePtr, F_OK) == 0 && loadManifest(manifestNamePtr, old)) {
+            skipSize = markCleanPages(old, tgtStat);
+        }
+        printf("update mode: %lu of %lu source bytes already in target\n", skipSize, srcSize);
+        if (tgtStat.st_size > tgtSize && ftruncate(tgtFd, tgtSize) != 0) {
+            printf("shrink target file %s failed %s\n", tgtNamePtr, strerror(errno));
+            close(tgtFd);
+            return failCopy(-6);
+        }
+    }
+    if (!checkHugePageCapacity(tgtFd, tgtNamePtr)) {
+        close(tgtFd);
+        return failCopy(-11);
+    }
+    if (manifestNamePtr && !createManifest(manifestNamePtr)) {
+        close(tgtFd);
+        return failCopy(-9);
     }
     printf("prepare to mmap target size %lu for source size  %lu\n", tgtSize, srcSize);
-    void *ptr = mmap(NULL, tgtSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB, tgtFd, 0);
+    // hugetlbfs sizes file by mapping, a plain file has to be sized before its pages can be written
+    if (!tgtHugetlbfs && ftruncate(tgtFd, tgtSize) != 0) {
+        printf("resize target file %s failed %s\n", tgtNamePtr, strerror(errno));
+        close(tgtFd);
+        return failCopy(-7);
+    }
+    void *ptr = mmap(NULL, tgtSize, PROT_READ | PROT_WRITE, MAP_SHARED | (tgtHugetlbfs ? MAP_HUGETLB : 0), tgtFd,
+        0);
     if (ptr == MAP_FAILED) {
-        printf("mmap target file %s failed %s", tgtNamePtr, strerror(errno));
-        return -7;
+        printf("mmap target file %s failed %s\n", tgtNamePtr, strerror(errno));
+        close(tgtFd);
+        return failCopy(-7);
     }
     close(tgtFd); // immediately close is better
     char *tgtPtr = (char *)ptr;
+    // workers pull page aligned chunks of target and pread straight into mapping
+    setChunkSize();
+    if (!setupNumaPlacement(tgtPtr)) {
+        munmap(ptr, tgtSize);
+        return failCopy(-8);
+    }
+    if (prefaultThreads > 0) {
+        // prefault walks same chunk queues as copy so pages are faulted from their own node
+        vector<int64_t> queueStart;
+        for (auto& queue : chunkQueues) queueStart.push_back(queue.next);
+        int64_t begin = nowNs();
+        vector<thread> workers;
+        for (int i = 0; i < prefaultThreads; i++) {
+            workers.emplace_back(prefaultWorker, tgtPtr, i);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        prefaultNs = nowNs() - begin;
+        printf("prefault %ld huge pages with %d thread(s) took %.2fs\n", prefaultPages.load(), prefaultThreads,
+            prefaultNs / 1e9);
+        if (copyFailed) {
+            munmap(ptr, tgtSize);
+            return failCopy(-12);
+        }
+        for (size_t i = 0; i < chunkQueues.size(); i++) chunkQueues[i].next = queueStart[i];
+    }
 
-    bool result = true;
     printf("prepare to concatenate model files at following order:\n");
-    for (auto it = filesInfo.begin(); it != filesInfo.end(); it ++) {
-        printf("name: %s size: %lu\n", it->first.c_str(), it->second);
-    } 
-    // we have to assume all model files's name must be alphabetical ordered
-    for (auto it = filesInfo.begin(); it != filesInfo.end(); it ++) {
-        if (!copyOneFile(it->first.c_str(), it->second, pageSize, tgtPtr)) {
-            result = false;
-            break;
+    for (auto it = sources.begin(); it != sources.end(); it ++) {
+        printf("name: %s size: %lu offset: %lu\n", it->name.c_str(), it->size, it->offset);
+    }
+    // io_uring reads land straight in target, copy kernel only applies to pread path
+    printf("copy with %d thread(s) and chunk size %lu%s copy kernel %s\n", threadNumber, chunkSize,
+        useIoUring ? " using io_uring" : "", copyKernelNames[copyKernel]);
+    if (memBudget > 0) {
+        printf("source page cache budget %lu, %ld chunk(s)\n", memBudget, max((int64_t)1, memBudget / chunkSize));
+    }
+    vector<thread> workers;
+    fileTimings.reset(new FileTiming[sources.size()]);
+    startNs = nowNs();
+    runningWorkers = threadNumber;
+    for (int i = 0; i < threadNumber; i++) {
+        workers.emplace_back([=] {
+            copyWorker(tgtPtr, i);
+            runningWorkers--;
+        });
+    }
+    monitorWorkers(workers, srcSize - skipSize);
+    closeSources();
+    bool result = !copyFailed && totalCopySize == srcSize - skipSize;
+    if (result && manifestNamePtr) {
+        combineFileCrc(tgtPtr);
+        if (finishManifest(manifestNamePtr, tgtNamePtr)) {
+            printf("\nmanifest written to %s and %s.json", manifestNamePtr, manifestNamePtr);
         }
-        tgtPtr += it->second;
-        // update_progress(totalCopySize * 100 / tgtSize);
+    } else if (manifestFd != -1) {
+        // journal keeps finished pages for a later --update
+        close(manifestFd);
     }
-   
+
     printf("\n%s copy from %s to target %s of total size %lu finished %ld\n", result?"Succeed":"Failed", 
-        srcNamePtr, tgtNamePtr, srcSize, totalCopySize);
+        srcNamePtr, tgtNamePtr, srcSize, totalCopySize.load());
+    for (size_t i = 0; i < sources.size(); i++) {
+        const FileTiming& timing = fileTimings[i];
+        if (timing.firstNs > timing.lastNs) continue;
+        double seconds = (timing.lastNs - timing.firstNs) / 1e9;
+        printf("file %s took %.2fs (%.2fs to %.2fs)\n", sources[i].name.c_str(), seconds,
+            (timing.firstNs - startNs) / 1e9, (timing.lastNs - startNs) / 1e9);
+    }
+    if (faultPages > 0 && verbose_flag) {
+        printf("page faults: %ld pages in %.2fs\n", faultPages.load(), faultNs / 1e9);
+    }
+    if (statsNamePtr && writeStats(statsNamePtr, srcNamePtr, tgtNamePtr, result, threadNumber)) {
+        printf("stats written to %s\n", statsNamePtr);
+    }
+    if (manageModels) {
+        finishModel(statePath, tgtPath, result);
+    }
+    if (numaMode != NUMA_NONE || verbose_flag) {
+        reportNumaPlacement(tgtPtr);
+    }
     munmap(ptr, tgtSize);  
-    return 0;
+    // failed copy must not look like success to scripts driving hugecp
+    return result ? 0 : -14;
 }
@@ -0,0 +1,408 @@
+// Benchmark of strategies hugecp could use to move a model file into hugepage memory.
+// Every run copies a synthetic source into a fresh target in given directory and prints
+// one json line with throughput and cpu time, so results from different boxes can be compared.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <getopt.h>
+#include "copy_kernel.h"
+
+using namespace std;
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+// same unit of work hugecp hands to a worker
+#define MIN_CHUNK_SIZE 16777216
+// bounce buffer of read_memcpy and non-temporal strategies, hugecp's default --buffer-size.
+// small enough to stay in L2, and a 1G page per thread would compete with the pool measured
+#define BUFFER_SIZE 1048576
+#define DIRECT_IO_ALIGN 4096
+
+enum Strategy {
+    READ_MEMCPY,  // read into buffer then memcpy, what hugecp's pread path does without streaming
+    PREAD_DIRECT, // pread straight into target mapping
+    ODIRECT,      // O_DIRECT pread straight into target mapping
+    MMAP_MEMCPY,  // mmap source and memcpy
+    NT_SSE2,      // pread into small buffer then non-temporal store into target, see copy_kernel.h
+    NT_AVX2,
+    NT_AVX512,
+    STRATEGY_COUNT
+};
+
+static const char *strategyNames[STRATEGY_COUNT] = {"read_memcpy", "pread_direct", "odirect", "mmap_memcpy",
+    "nt_sse2", "nt_avx2", "nt_avx512"};
+
+// copy kernel used by streaming strategies
+CopyKernel strategyKernel(Strategy strategy) {
+    switch (strategy) {
+        case NT_SSE2:
+            return COPY_SSE2;
+        case NT_AVX2:
+            return COPY_AVX2;
+        case NT_AVX512:
+            return COPY_AVX512;
+        default:
+            return COPY_MEMCPY;
+    }
+}
+
+struct BenchRun {
+    Strategy strategy;
+    int threads;
+    int64_t pageSize;
+    string targetDir;
+};
+
+static string srcName;
+static off_t srcSize = 0;
+static atomic<int64_t> nextChunk(0);
+static atomic<bool> runFailed(false);
+
+// pread until len bytes arrived or EOF, returns bytes read or -1
+ssize_t preadFully(int fd, char *dst, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t size = pread(fd, dst + done, len - done, offset + done);
+        if (size == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (size == 0) break;
+        done += size;
+    }
+    return done;
+}
+
+// existing source is used as is, otherwise write some cheap non-repeating data
+// so compression or dedup underneath doesn't flatter results
+bool prepareSource(const string& name, off_t size) {
+    struct stat st;
+    if (stat(name.c_str(), &st) == 0) {
+        srcSize = st.st_size;
+        return srcSize > 0;
+    }
+    int fd = open(name.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "source file %s cannot be created! %s\n", name.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(stderr, "generating %lu bytes synthetic source %s\n", size, name.c_str());
+    vector<uint64_t> block(MIN_CHUNK_SIZE / sizeof(uint64_t));
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (off_t done = 0; done < size; ) {
+        for (auto& v : block) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            v = state;
+        }
+        size_t len = min((off_t)(block.size() * sizeof(uint64_t)), size - done);
+        if (write(fd, block.data(), len) != (ssize_t)len) {
+            fprintf(stderr, "write source file %s failed %s\n", name.c_str(), strerror(errno));
+            close(fd);
+            return false;
+        }
+        done += len;
+    }
+    fsync(fd);
+    close(fd);
+    srcSize = size;
+    return true;
+}
+
+// drop source from page cache so every run reads from device
+void dropSourceCache() {
+    int fd = open(srcName.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void benchWorker(const BenchRun& run, char *tgtBase, int fd, const char *srcMap, int64_t chunkSize) {
+    int64_t chunkNumber = (srcSize + chunkSize - 1) / chunkSize;
+    bool buffered = run.strategy == READ_MEMCPY || strategyKernel(run.strategy) != COPY_MEMCPY;
+    CopyFunc copy = copyKernelFunc(strategyKernel(run.strategy));
+    size_t bufferSize = buffered ? BUFFER_SIZE : 0;
+    char *buffer = nullptr;
+    if (bufferSize && posix_memalign((void **)&buffer, DIRECT_IO_ALIGN, bufferSize) != 0) {
+        runFailed = true;
+        return;
+    }
+    while (!runFailed) {
+        int64_t i = nextChunk++;
+        if (i >= chunkNumber) break;
+        off_t begin = i * chunkSize;
+        off_t end = min(begin + chunkSize, srcSize);
+        switch (run.strategy) {
+            case READ_MEMCPY:
+            case NT_SSE2:
+            case NT_AVX2:
+            case NT_AVX512:
+                for (off_t pos = begin; pos < end; pos += bufferSize) {
+                    size_t len = min((off_t)bufferSize, end - pos);
+                    if (preadFully(fd, buffer, len, pos) != (ssize_t)len) {
+                        runFailed = true;
+                        break;
+                    }
+                    copy(tgtBase + pos, buffer, len);
+                }
+                break;
+            case PREAD_DIRECT:
+                if (preadFully(fd, tgtBase + begin, end - begin, begin) != end - begin) runFailed = true;
+                break;
+            case ODIRECT: {
+                // O_DIRECT wants aligned length too, tail of file is rounded up into target slack
+                size_t len = (end - begin + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+                if (preadFully(fd, tgtBase + begin, len, begin) != end - begin) runFailed = true;
+                break;
+            }
+            case MMAP_MEMCPY:
+                memcpy(tgtBase + begin, srcMap + begin, end - begin);
+                break;
+            default:
+                break;
+        }
+    }
+    free(buffer);
+}
+
+double timevalSeconds(const struct timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// returns false when combination can't run on this box, prints one json line otherwise
+bool runBench(const BenchRun& run, bool dropCache, int repeat) {
+    if (!copyKernelSupported(strategyKernel(run.strategy))) {
+        fprintf(stderr, "skip %s, not supported by this cpu\n", strategyNames[run.strategy]);
+        return false;
+    }
+    struct statfs fs;
+    if (statfs(run.targetDir.c_str(), &fs) != 0) {
+        fprintf(stderr, "target directory %s is not valid %s\n", run.targetDir.c_str(), strerror(errno));
+        return false;
+    }
+    bool hugetlbfs = fs.f_type == HUGETLBFS_MAGIC;
+    if (hugetlbfs && fs.f_bsize != run.pageSize) {
+        fprintf(stderr, "skip page size %ld on %s, mount uses %ld\n", run.pageSize, run.targetDir.c_str(), (long)fs.f_bsize);
+        return false;
+    }
+    int fd = open(srcName.c_str(), O_RDONLY | (run.strategy == ODIRECT ? O_DIRECT : 0));
+    if (fd == -1) {
+        fprintf(stderr, "skip %s, source cannot be opened %s\n", strategyNames[run.strategy], strerror(errno));
+        return false;
+    }
+    int64_t tgtSize = (srcSize + run.pageSize - 1) / run.pageSize * run.pageSize;
+    int64_t chunkSize = (max(run.pageSize, (int64_t)MIN_CHUNK_SIZE) + run.pageSize - 1) / run.pageSize * run.pageSize;
+    string tgtName = run.targetDir + "/hugecp_bench." + to_string(getpid());
+
+    for (int r = 0; r < repeat; r++) {
+        if (dropCache) dropSourceCache();
+        int tgtFd = open(tgtName.c_str(), O_CREAT | O_RDWR | O_EXCL, 0600);
+        if (tgtFd == -1 || (!hugetlbfs && ftruncate(tgtFd, tgtSize) != 0)) {
+            fprintf(stderr, "target file %s cannot be created! %s\n", tgtName.c_str(), strerror(errno));
+            if (tgtFd != -1) close(tgtFd);
+            close(fd);
+            return false;
+        }
+        void *ptr = mmap(NULL, tgtSize, PROT_READ | PROT_WRITE, MAP_SHARED | (hugetlbfs ? MAP_HUGETLB : 0), tgtFd, 0);
+        close(tgtFd);
+        if (ptr == MAP_FAILED) {
+            fprintf(stderr, "mmap target file %s failed %s\n", tgtName.c_str(), strerror(errno));
+            unlink(tgtName.c_str());
+            close(fd);
+            return false;
+        }
+        const char *srcMap = nullptr;
+        struct rusage usageBegin, usageEnd;
+        getrusage(RUSAGE_SELF, &usageBegin);
+        auto begin = chrono::steady_clock::now();
+        // source mapping is part of the strategy cost
+        if (run.strategy == MMAP_MEMCPY) {
+            void *map = mmap(NULL, srcSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                runFailed = true;
+            } else {
+                madvise(map, srcSize, MADV_SEQUENTIAL);
+                srcMap = (const char *)map;
+            }
+        }
+        nextChunk = 0;
+        vector<thread> workers;
+        for (int i = 0; i < run.threads && !runFailed; i++) {
+            workers.emplace_back(benchWorker, cref(run), (char *)ptr, fd, srcMap, chunkSize);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (srcMap) munmap((void *)srcMap, srcSize);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        getrusage(RUSAGE_SELF, &usageEnd);
+        munmap(ptr, tgtSize);
+        unlink(tgtName.c_str());
+        if (runFailed) {
+            fprintf(stderr, "%s failed on %s %s\n", strategyNames[run.strategy], run.targetDir.c_str(), strerror(errno));
+            runFailed = false;
+            close(fd);
+            return false;
+        }
+        printf("{\"strategy\": \"%s\", \"threads\": %d, \"page_size\": %ld, \"target_dir\": \"%s\", "
+            "\"hugetlbfs\": %s, \"cold\": %s, \"run\": %d, \"bytes\": %ld, \"seconds\": %.6f, \"gbps\": %.3f, "
+            "\"cpu_user\": %.6f, \"cpu_sys\": %.6f}\n",
+            strategyNames[run.strategy], run.threads, run.pageSize, run.targetDir.c_str(),
+            hugetlbfs ? "true" : "false", dropCache ? "true" : "false", r, srcSize, seconds, srcSize / seconds / 1e9,
+            timevalSeconds(usageEnd.ru_utime) - timevalSeconds(usageBegin.ru_utime),
+            timevalSeconds(usageEnd.ru_stime) - timevalSeconds(usageBegin.ru_stime));
+        fflush(stdout);
+    }
+    close(fd);
+    return true;
+}
+
+vector<string> splitList(const char *str) {
+    vector<string> items;
+    string item;
+    for (const char *p = str; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (!item.empty()) items.push_back(item);
+            item.clear();
+            if (*p == '\0') break;
+        } else {
+            item += *p;
+        }
+    }
+    return items;
+}
+
+int main(int argc, char **argv) {
+    struct option long_options[] = {
+        {"source", required_argument, 0, 'i'},
+        {"size", required_argument, 0, 's'},
+        {"target-dir", required_argument, 0, 'o'},
+        {"strategy", required_argument, 0, 'S'},
+        {"threads", required_argument, 0, 't'},
+        {"page-size", required_argument, 0, 'p'},
+        {"repeat", required_argument, 0, 'r'},
+        {"cold", no_argument, 0, 'c'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0} // Required terminator
+    };
+    const char* help = "<-i sourceFilename> [--size 4G] <-o targetDirectory>... [--strategy name,...]\n"
+        "    [--threads 1,4,...] [--page-size 2M,1G] [--repeat N] [--cold] [--help]\n"
+        "  strategies: read_memcpy pread_direct odirect mmap_memcpy nt_sse2 nt_avx2 nt_avx512 (default all)\n"
+        "  source of --size is generated when missing, --cold drops it from page cache before each run";
+
+    vector<string> targetDirs;
+    vector<Strategy> strategies;
+    vector<int> threadNumbers;
+    vector<int64_t> pageSizes;
+    off_t size = 4LL * 1024 * 1024 * 1024;
+    int repeat = 1;
+    bool dropCache = false;
+    int option_index = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hci:s:o:S:t:p:r:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'i':
+                srcName = optarg;
+                break;
+            case 's':
+                if ((size = parseSize(optarg)) <= 0) {
+                    fprintf(stderr, "Error: invalid --size %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                targetDirs.push_back(optarg);
+                break;
+            case 'S':
+                for (auto& name : splitList(optarg)) {
+                    auto it = find_if(strategyNames, strategyNames + STRATEGY_COUNT,
+                        [&](const char *s) { return name == s; });
+                    if (it == strategyNames + STRATEGY_COUNT) {
+                        fprintf(stderr, "Error: unknown strategy %s.\n", name.c_str());
+                        return 1;
+                    }
+                    strategies.push_back((Strategy)(it - strategyNames));
+                }
+                break;
+            case 't':
+                for (auto& item : splitList(optarg)) {
+                    if (atoi(item.c_str()) < 1) {
+                        fprintf(stderr, "Error: --threads requires positive numbers.\n");
+                        return 1;
+                    }
+                    threadNumbers.push_back(atoi(item.c_str()));
+                }
+                break;
+            case 'p':
+                for (auto& item : splitList(optarg)) {
+                    int64_t pageSize = parseSize(item.c_str());
+                    if (pageSize <= 0 || (pageSize & (pageSize - 1))) {
+                        fprintf(stderr, "Error: invalid page size %s.\n", item.c_str());
+                        return 1;
+                    }
+                    pageSizes.push_back(pageSize);
+                }
+                break;
+            case 'r':
+                repeat = max(1, atoi(optarg));
+                break;
+            case 'c':
+                dropCache = true;
+                break;
+            case 'h':
+                printf("Usage: %s %s\n", argv[0], help);
+                return 0;
+            case '?':
+                /* getopt_long already printed an error message. */
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (srcName.empty() || targetDirs.empty()) {
+        fprintf(stderr, "Error: -i and -o options are required.\n");
+        printf("Usage: %s %s\n", argv[0], help);
+        return 1;
+    }
+    if (strategies.empty()) {
+        for (int i = 0; i < STRATEGY_COUNT; i++) strategies.push_back((Strategy)i);
+    }
+    if (threadNumbers.empty()) {
+        // one cpu box would run everything twice at 1 thread
+        threadNumbers = {1};
+        if (thread::hardware_concurrency() > 1) threadNumbers.push_back(thread::hardware_concurrency());
+    }
+    if (pageSizes.empty()) pageSizes = {2097152, 1073741824};
+
+    if (!prepareSource(srcName, size)) return 2;
+
+    int runs = 0;
+    for (auto& targetDir : targetDirs) {
+        for (int64_t pageSize : pageSizes) {
+            for (Strategy strategy : strategies) {
+                for (int threads : threadNumbers) {
+                    if (runBench({strategy, threads, pageSize, targetDir}, dropCache, repeat)) runs++;
+                }
+            }
+        }
+    }
+    return runs > 0 ? 0 : 3;
+}
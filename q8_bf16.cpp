@@ -1,217 +1,184 @@
+#include "dequant_kernel.h"
+#include "gguf_writer.h"
+#include "tensor_catalog.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
-#include <numeric> // For std::accumulate
+#include <numeric>
 #include <string>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <vector>
 
+// Read-only typed view of a tensor inside a mapped source shard
+template <typename T> struct TensorSpan {
+  const T *ptr = nullptr;
+  size_t count = 0;
+  // aligned copy when the tensor isn't aligned to its element size in the
+  // mapping, writers normally pad the header so that it is
+  std::shared_ptr<std::vector<T>> copy;
+
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
+  const T *data() const { return ptr; }
+  const T &operator[](size_t i) const { return ptr[i]; }
+};
+
+// Source safetensors shard mapped once for the whole run. Tensors are read
+// in place by the kernels instead of being copied out through a stream
+// opened for every tensor.
+struct ShardMapping {
+  const char *base = nullptr;
+  size_t size = 0;
+  uint64_t data_start = 0; // 8 byte header length + header
+};
+
+// indexed by TensorEntry::shard
+typedef std::vector<ShardMapping> ShardMap;
+
+bool openShard(const std::string &path, ShardMapping &shard);
+void closeShard(ShardMapping &shard);
+template <typename T>
+TensorSpan<T> tensorSpan(const ShardMap &shards, const TensorEntry &entry);
+
 // Assume these utility functions are defined elsewhere
 bool ends_with(const std::string &str, const std::string &suffix);
-typedef uint16_t bfloat16;
-bfloat16 float_to_bfloat16(float f);
-float bfloat16_to_float(bfloat16 bf);
-std::vector<bfloat16>
-weight_dequant_cpu(const std::vector<uint8_t> &quantized_weight,
-                   const std::vector<float> &scale_inv, long long M,
-                   long long N, int block_size);
-template <typename T>
-std::vector<T> load_tensor_data(const std::string &filename, int64_t offset,
-                                size_t num_bytes);
-std::vector<bfloat16>
-dequantizeOneweight(const std::string &weight_name,
-                    const std::string &model_path,
-                    const std::map<std::string, std::string> &weight_map,
-                    const std::map<std::string, std::vector<nlohmann::json>>
-                        &chunk_weight_details);
-void writeOneTensorToFile(std::ofstream &outfile,
-                          const std::vector<bfloat16> &tensor_data);
-void writeOneTensorToFile(std::ofstream &outfile,
-                          const std::vector<char> &tensor_data);
-std::pair<nlohmann::json, std::map<std::string, std::vector<nlohmann::json>>>
-calculateMetaDataRevised(const std::string &model_path);
+bool checkBlockScales(const TensorSpan<uint8_t> &quantized_weight,
+                      const TensorSpan<float> &scale_inv, long long M,
+                      long long N, long long row_begin, long long row_end,
+                      int block_size);
+bool weight_dequant_cpu(const TensorSpan<uint8_t> &quantized_weight,
+                        const TensorSpan<float> &scale_inv, long long M,
+                        long long N, long long row_begin, long long row_end,
+                        bfloat16 *dst, int block_size);
+bool weight_requant_q8_0(const TensorSpan<uint8_t> &quantized_weight,
+                         const TensorSpan<float> &scale_inv, long long M,
+                         long long N, long long row_begin, long long row_end,
+                         BlockQ8_0 *dst, int block_size);
+void adviseSource(const void *begin, size_t num_bytes, int advice);
 void update_progress(int progress); // Assume this is defined
 
-std::pair<nlohmann::json, std::map<std::string, std::vector<nlohmann::json>>>
-calculateMetaDataRevised(const std::string &model_path) {
-  nlohmann::json final_metadata_json;
-  final_metadata_json["__metadata__"] = {{"format", "pt"}};
-  std::map<std::string, std::vector<nlohmann::json>> chunk_weight_details;
-  uint64_t current_offset = 0;
-
-  std::string model_index_file = model_path + "/model.safetensors.index.json";
-  std::ifstream f(model_index_file);
-  if (!f.is_open()) {
-    std::cerr << "Error: Could not open " << model_index_file << std::endl;
-    return {final_metadata_json, chunk_weight_details};
-  }
-  nlohmann::json model_index;
-  f >> model_index;
-  f.close();
-
-  auto weight_map =
-      model_index["weight_map"].get<std::map<std::string, std::string>>();
-
-  std::map<std::string, nlohmann::json> all_chunk_metadata;
-  std::vector<std::string> safetensor_files;
-  for (const auto &entry : std::filesystem::directory_iterator(model_path)) {
-    if (entry.is_regular_file() && entry.path().extension() == ".safetensors") {
-      safetensor_files.push_back(entry.path().filename().string());
-    }
+// Rows converted at a time, one row of DeepSeek's 128x128 scale blocks
+static const long long tile_rows = 128;
+// Tensors copied as they are go through the same in pieces of this size
+static const uint64_t copy_piece = 16 << 20;
+
+// Caps bytes of tiles held at the same time by worker threads. A tile bigger
+// than the whole budget still runs, alone.
+struct MemoryBudget {
+  uint64_t limit;
+  uint64_t in_use = 0;
+  std::mutex mutex;
+  std::condition_variable released;
+
+  explicit MemoryBudget(uint64_t limit) : limit(limit) {}
+  void acquire(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock,
+                  [&] { return in_use == 0 || in_use + bytes <= limit; });
+    in_use += bytes;
   }
-  std::sort(safetensor_files.begin(), safetensor_files.end());
+  void release(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_use -= bytes;
+    released.notify_all();
+  }
+};
 
-  // Read all chunk metadata
-  for (const auto &file_name : safetensor_files) {
-    std::string safetensor_file_path = model_path + "/" + file_name;
-    std::ifstream infile(safetensor_file_path, std::ios::binary);
-    if (!infile.is_open()) {
-      std::cerr << "Error: Could not open file " << safetensor_file_path
-                << std::endl;
-      continue;
-    }
+// Chosen in main from --kernel, scalar until then
+static DequantFunc dequant_func = dequant_scalar;
 
-    uint64_t metadata_len;
-    if (!infile.read(reinterpret_cast<char *>(&metadata_len),
-                     sizeof(metadata_len))) {
-      std::cerr << "Error reading metadata length from " << safetensor_file_path
-                << std::endl;
-      infile.close();
-      continue;
-    }
-    std::string metadata_str(metadata_len, '\0');
-    if (!infile.read(metadata_str.data(), metadata_len)) {
-      std::cerr << "Error reading metadata from " << safetensor_file_path
-                << std::endl;
-      infile.close();
-      continue;
-    }
-    try {
-      all_chunk_metadata[file_name] = nlohmann::json::parse(metadata_str);
-    } catch (const nlohmann::json::parse_error &e) {
-      std::cerr << "Error parsing JSON metadata in " << safetensor_file_path
-                << ": " << e.what() << std::endl;
-    }
-    infile.close();
-  }
-
-  // Pre-calculate final metadata and chunk weight details
-  for (const auto &[global_tensor_name, chunk_file_name] : weight_map) {
-    if (all_chunk_metadata.count(chunk_file_name) &&
-        all_chunk_metadata[chunk_file_name].count(global_tensor_name)) {
-      nlohmann::json tensor_info =
-          all_chunk_metadata[chunk_file_name][global_tensor_name];
-      std::string dtype_str = tensor_info["dtype"].get<std::string>();
-      std::vector<long long> shape =
-          tensor_info["shape"].get<std::vector<long long>>();
-      std::vector<int64_t> data_offsets =
-          tensor_info["data_offsets"].get<std::vector<int64_t>>();
-
-      nlohmann::json weight_detail;
-      weight_detail["name"] = global_tensor_name;
-      weight_detail["dtype"] = dtype_str;
-      weight_detail["shape"] = shape;
-      weight_detail["data_offsets"] = data_offsets;
-
-      if (chunk_weight_details.find(chunk_file_name) ==
-          chunk_weight_details.end()) {
-        chunk_weight_details[chunk_file_name] = {weight_detail};
-      } else {
-        chunk_weight_details[chunk_file_name].push_back(weight_detail);
-      }
+// Output safetensors file mapped from hugetlbfs. Every tensor is written
+// straight to its data_offsets slot, so the result never touches disk and
+// doesn't need a second pass through hugecp.
+struct HugetlbOutput {
+  char *base = nullptr;
+  size_t mapped_size = 0;
+  uint64_t data_start = 0; // 8 byte header length + header
+};
 
-      if (dtype_str == "F8_E4M3" || dtype_str == "BF16" ||
-          dtype_str == "float32" || dtype_str == "F32") {
-        if (shape.size() != 2) {
-          std::cerr << "Error: Tensor " << global_tensor_name
-                    << " has shape of size " << shape.size()
-                    << ", which is not 2. Skipping for BF16 conversion."
-                    << std::endl;
-          // Copy original metadata
-          final_metadata_json[global_tensor_name] = tensor_info;
-          final_metadata_json[global_tensor_name]["data_offsets"] = {
-              current_offset,
-              current_offset +
-                  (tensor_info.contains("num_bytes")
-                       ? tensor_info["num_bytes"].get<size_t>()
-                       : (shape.empty()
-                              ? 0
-                              : std::accumulate(shape.begin(), shape.end(), 1LL,
-                                                std::multiplies<long long>()) *
-                                    (dtype_str == "BF16"
-                                         ? sizeof(bfloat16)
-                                         : (dtype_str == "float32" ||
-                                                    dtype_str == "F32"
-                                                ? sizeof(float)
-                                                : 1))))};
-          current_offset +=
-              final_metadata_json[global_tensor_name]["data_offsets"][1]
-                  .get<uint64_t>() -
-              final_metadata_json[global_tensor_name]["data_offsets"][0]
-                  .get<uint64_t>();
-
-        } else {
-          size_t tensor_size_bytes =
-              std::accumulate(shape.begin(), shape.end(), 1LL,
-                              std::multiplies<long long>()) *
-              sizeof(bfloat16);
-          final_metadata_json[global_tensor_name] = {
-              {"dtype", "BF16"},
-              {"shape", shape},
-              {"data_offsets",
-               {current_offset, current_offset + tensor_size_bytes}}};
-          current_offset += tensor_size_bytes;
-        }
-      } else {
-        // Copy metadata for other dtypes
-        final_metadata_json[global_tensor_name] = tensor_info;
-        final_metadata_json[global_tensor_name]["data_offsets"] = {
-            current_offset,
-            current_offset +
-                (tensor_info.contains("num_bytes")
-                     ? tensor_info["num_bytes"].get<size_t>()
-                     : (shape.empty()
-                            ? 0
-                            : std::accumulate(shape.begin(), shape.end(), 1LL,
-                                              std::multiplies<long long>()) *
-                                  (dtype_str == "BF16"
-                                       ? sizeof(bfloat16)
-                                       : (dtype_str == "float32" ||
-                                                  dtype_str == "F32"
-                                              ? sizeof(float)
-                                              : 1))))};
-        current_offset +=
-            final_metadata_json[global_tensor_name]["data_offsets"][1]
-                .get<uint64_t>() -
-            final_metadata_json[global_tensor_name]["data_offsets"][0]
-                .get<uint64_t>();
-      }
-    }
-  }
+bool openHugetlbOutput(const std::string &path, const std::string &prefix,
+                       uint64_t data_size, bool resume, HugetlbOutput &out);
+void closeHugetlbOutput(HugetlbOutput &out);
+
+// One output safetensors or GGUF file, written with pwrite or mapped from
+// hugetlbfs
+struct OutputShard {
+  std::string name;
+  int fd = -1;
+  uint64_t data_start = 0;
+  HugetlbOutput hugetlb;
+};
+
+// Journal of tensors durably written, kept next to the output as
+// q8_bf16.journal while converting: header, then one state byte per catalog
+// entry. Finished tensors are recorded in batches, output files are synced
+// before their states are written and the journal is synced after, so a
+// state never claims data which could still be lost. --resume skips them.
+#define JOURNAL_MAGIC "Q8BF16J1"
+#define TENSOR_PENDING 0
+#define TENSOR_WRITTEN 1
+
+struct JournalHeader {
+  char magic[8];
+  uint64_t layout_hash; // of every output header and data size
+  uint64_t entry_count;
+};
+
+// a batch is synced once it holds this many bytes or tensors
+static const uint64_t journal_batch_bytes = 1ULL << 30;
+static const size_t journal_batch_tensors = 4096;
+
+struct ConversionJournal {
+  int fd = -1;
+  std::vector<uint8_t> states;
+  std::vector<size_t> batch; // written, not synced yet
+  uint64_t batch_bytes = 0;
+  std::mutex mutex;      // batch
+  std::mutex sync_mutex; // one sync at a time
+  const std::vector<OutputShard> *outputs = nullptr;
+};
+
+bool openJournal(const std::string &path, uint64_t layout_hash,
+                 size_t entry_count, bool resume, ConversionJournal &journal);
+bool journalTensor(ConversionJournal &journal, size_t entry, uint64_t bytes);
+bool syncJournal(ConversionJournal &journal);
+
+std::string outputShardName(size_t shard, size_t shard_count, bool sharded);
+bool openOutputFile(const std::string &path, const std::string &prefix,
+                    uint64_t data_size, bool resume, OutputShard &output);
+bool writeTensorPiece(OutputShard &output, const TensorEntry &entry,
+                      uint64_t offset, const void *data, size_t num_bytes);
+bool convertTensor(const TensorEntry &entry, const TensorCatalog &catalog,
+                   const ShardMap &shards, OutputShard &output);
+bool copyTensor(const TensorEntry &entry, const ShardMap &shards,
+                OutputShard &output);
+bool widenTensor(const TensorEntry &entry, const ShardMap &shards,
+                 OutputShard &output);
+uint64_t tileBytes(const TensorEntry &entry);
 
-  return {final_metadata_json, chunk_weight_details};
-}
 bool ends_with(const std::string &str, const std::string &suffix) {
   return str.size() >= suffix.size() &&
          0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
 }
 
-bfloat16 float_to_bfloat16(float f) {
-  uint32_t f_bits = *reinterpret_cast<uint32_t *>(&f);
-  uint32_t bf16_bits = (f_bits >> 16);
-  return *reinterpret_cast<bfloat16 *>(&bf16_bits);
-}
-
-float bfloat16_to_float(bfloat16 bf) {
-  uint32_t bf16_bits = *reinterpret_cast<uint16_t *>(&bf);
-  uint32_t f_bits = bf16_bits << 16;
-  return *reinterpret_cast<float *>(&f_bits);
-}
-
 void update_progress(int progress) {
   int bar_length = 40;
   int filled_length = (int)(bar_length * progress / 100.0);
@@ -228,19 +195,20 @@ void update_progress(int progress) {
   fflush(stdout);
 }
 
-std::vector<bfloat16>
-weight_dequant_cpu(const std::vector<uint8_t> &quantized_weight,
-                   const std::vector<float> &scale_inv, long long M,
-                   long long N, int block_size = 128) {
+// Checks an M x N FP8 weight against its block_size x block_size scales
+bool checkBlockScales(const TensorSpan<uint8_t> &quantized_weight,
+                      const TensorSpan<float> &scale_inv, long long M,
+                      long long N, long long row_begin, long long row_end,
+                      int block_size) {
   if (quantized_weight.empty() || scale_inv.empty() || M <= 0 || N <= 0 ||
-      block_size <= 0) {
+      block_size <= 0 || row_begin < 0 || row_end > M) {
     std::cerr << "Error: Invalid input to weight_dequant_cpu." << std::endl;
-    return {};
+    return false;
   }
   if (quantized_weight.size() != M * N) {
     std::cerr << "Error: quantized_weight size does not match M * N."
               << std::endl;
-    return {};
+    return false;
   }
 
   long long num_row_blocks = (M + block_size - 1) / block_size;
@@ -250,243 +218,667 @@ weight_dequant_cpu(const std::vector<uint8_t> &quantized_weight,
                  "blocks ("
               << num_row_blocks * num_col_blocks << " vs " << scale_inv.size()
               << ")." << std::endl;
-    return {};
+    return false;
   }
+  return true;
+}
 
-  std::vector<bfloat16> dequantized_weight(M * N);
-
-  for (long long row_block_idx = 0; row_block_idx < num_row_blocks;
-       ++row_block_idx) {
-    for (long long col_block_idx = 0; col_block_idx < num_col_blocks;
-         ++col_block_idx) {
-      float current_scale_inv =
-          scale_inv[row_block_idx * num_col_blocks + col_block_idx];
-      float current_scale = 1.0f / current_scale_inv;
-
-      for (int row_offset = 0; row_offset < block_size; ++row_offset) {
-        for (int col_offset = 0; col_offset < block_size; ++col_offset) {
-          long long row_index = row_block_idx * block_size + row_offset;
-          long long col_index = col_block_idx * block_size + col_offset;
-
-          if (row_index < M && col_index < N) {
-            long long weight_index = row_index * N + col_index;
-            float dequantized_value =
-                static_cast<float>(quantized_weight[weight_index]) *
-                current_scale;
-            dequantized_weight[weight_index] =
-                float_to_bfloat16(dequantized_value);
-          }
-        }
-      }
+// Dequantizes rows [row_begin, row_end) of an M x N weight into dst
+bool weight_dequant_cpu(const TensorSpan<uint8_t> &quantized_weight,
+                        const TensorSpan<float> &scale_inv, long long M,
+                        long long N, long long row_begin, long long row_end,
+                        bfloat16 *dst, int block_size = 128) {
+  if (!checkBlockScales(quantized_weight, scale_inv, M, N, row_begin, row_end,
+                        block_size)) {
+    return false;
+  }
+  long long num_col_blocks = (N + block_size - 1) / block_size;
+
+  // Rows are walked in memory order, each block's run of a row shares one
+  // scale. scale_inv is the dequantization factor itself (x * scale_inv),
+  // as in DeepSeek's weight_dequant.
+  for (long long row = row_begin; row < row_end; ++row) {
+    const float *row_scales = &scale_inv[(row / block_size) * num_col_blocks];
+    const uint8_t *src = &quantized_weight[row * N];
+    bfloat16 *row_dst = dst + (row - row_begin) * N;
+    for (long long col_block = 0; col_block < num_col_blocks; ++col_block) {
+      long long col = col_block * block_size;
+      long long len = std::min<long long>(block_size, N - col);
+      dequant_func(src + col, row_dst + col, len, row_scales[col_block]);
     }
   }
 
-  return dequantized_weight;
+  return true;
 }
 
-template <typename T>
-std::vector<T> load_tensor_data(const std::string &filename, int64_t offset,
-                                size_t num_bytes) {
-  std::ifstream file(filename, std::ios::binary);
-  if (!file.is_open()) {
-    std::cerr << "Error: Could not open file " << filename << std::endl;
-    return {};
+// Requantizes rows [row_begin, row_end) of an M x N weight to Q8_0 blocks in
+// dst, N is a multiple of 32 so blocks never straddle a scale block
+bool weight_requant_q8_0(const TensorSpan<uint8_t> &quantized_weight,
+                         const TensorSpan<float> &scale_inv, long long M,
+                         long long N, long long row_begin, long long row_end,
+                         BlockQ8_0 *dst, int block_size = 128) {
+  if (!checkBlockScales(quantized_weight, scale_inv, M, N, row_begin, row_end,
+                        block_size)) {
+    return false;
   }
-  file.seekg(offset, std::ios::beg);
-  std::vector<T> data(num_bytes / sizeof(T));
-  if (!file.read(reinterpret_cast<char *>(data.data()), num_bytes)) {
-    std::cerr << "Error reading " << num_bytes << " bytes from " << filename
-              << " at offset " << offset << std::endl;
-    return {};
+  long long num_col_blocks = (N + block_size - 1) / block_size;
+  long long row_blocks = N / q8_0_block_size;
+
+  for (long long row = row_begin; row < row_end; ++row) {
+    const float *row_scales = &scale_inv[(row / block_size) * num_col_blocks];
+    const uint8_t *src = &quantized_weight[row * N];
+    BlockQ8_0 *row_dst = dst + (row - row_begin) * row_blocks;
+    for (long long col_block = 0; col_block < num_col_blocks; ++col_block) {
+      long long col = col_block * block_size;
+      long long len = std::min<long long>(block_size, N - col);
+      quantize_q8_0(src + col, row_dst + col / q8_0_block_size, len,
+                    row_scales[col_block]);
+    }
   }
-  file.close();
-  return data;
+  return true;
 }
-void writeOneTensorToFile(std::ofstream &outfile,
-                          const std::vector<bfloat16> &tensor_data) {
-  if (outfile.is_open() && !tensor_data.empty()) {
-    outfile.write(reinterpret_cast<const char *>(tensor_data.data()),
-                  tensor_data.size() * sizeof(bfloat16));
-  } else if (!outfile.is_open()) {
-    std::cerr << "Error: Output file is not open." << std::endl;
-  } else if (tensor_data.empty()) {
-    std::cerr << "Warning: Tensor data is empty, nothing to write."
+
+bool openShard(const std::string &path, ShardMapping &shard) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    std::cerr << "Error: Could not open file " << path << ": "
+              << strerror(errno) << std::endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  uint64_t header_len = 0;
+  if (st.st_size < (off_t)sizeof(header_len) ||
+      pread(fd, &header_len, sizeof(header_len), 0) != sizeof(header_len) ||
+      header_len > st.st_size - sizeof(header_len)) {
+    std::cerr << "Error: " << path << " is not a safetensors file."
               << std::endl;
+    close(fd);
+    return false;
   }
+  void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    std::cerr << "Error: mmap of " << path << " failed: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  // tensors are consumed front to back, read ahead generously
+  madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+  shard.base = static_cast<const char *>(ptr);
+  shard.size = st.st_size;
+  shard.data_start = sizeof(header_len) + header_len;
+  return true;
 }
 
-void writeOneTensorToFile(std::ofstream &outfile,
-                          const std::vector<char> &tensor_data) {
-  if (outfile.is_open() && !tensor_data.empty()) {
-    outfile.write(tensor_data.data(), tensor_data.size());
-  } else if (!outfile.is_open()) {
-    std::cerr << "Error: Output file is not open." << std::endl;
-  } else if (tensor_data.empty()) {
-    std::cerr << "Warning: Tensor data is empty, nothing to write."
-              << std::endl;
+void closeShard(ShardMapping &shard) {
+  if (shard.base != nullptr) {
+    munmap(const_cast<char *>(shard.base), shard.size);
+    shard.base = nullptr;
   }
 }
 
-// Assume these utility functions are defined elsewhere
-bool ends_with(const std::string &str, const std::string &suffix);
-typedef uint16_t bfloat16;
-bfloat16 float_to_bfloat16(float f);
-float bfloat16_to_float(bfloat16 bf);
-std::vector<bfloat16>
-weight_dequant_cpu(const std::vector<uint8_t> &quantized_weight,
-                   const std::vector<float> &scale_inv, long long M,
-                   long long N, int block_size);
+// data_offsets count from the end of the header, not from the file start.
+// The catalog checked them against the shard when it was parsed.
 template <typename T>
-std::vector<T> load_tensor_data(const std::string &filename, int64_t offset,
-                                size_t num_bytes);
-
-std::vector<bfloat16>
-dequantizeOneweight(const std::string &weight_name,
-                    const std::string &model_path,
-                    const std::map<std::string, std::string>
-                        &weight_map, // We might not even need this anymore!
-                    const std::map<std::string, std::vector<nlohmann::json>>
-                        &chunk_weight_details) {
-
-  if (!weight_map.count(weight_name)) {
-    std::cerr << "Error: Weight name '" << weight_name
-              << "' not found in weight map." << std::endl;
+TensorSpan<T> tensorSpan(const ShardMap &shards, const TensorEntry &entry) {
+  const ShardMapping &shard = shards[entry.shard];
+  size_t num_bytes = entry.sourceBytes();
+  if (entry.end > shard.size - shard.data_start || num_bytes % sizeof(T) != 0) {
+    std::cerr << "Error: Tensor " << entry.name
+              << " has invalid data_offsets." << std::endl;
     return {};
   }
+  const char *begin = shard.base + shard.data_start + entry.begin;
+  TensorSpan<T> span;
+  span.count = num_bytes / sizeof(T);
+  if ((uintptr_t)begin % alignof(T) != 0) {
+    span.copy = std::make_shared<std::vector<T>>(span.count);
+    memcpy(span.copy->data(), begin, num_bytes);
+    span.ptr = span.copy->data();
+  } else {
+    span.ptr = reinterpret_cast<const T *>(begin);
+  }
+  return span;
+}
 
-  std::string chunk_file_name = weight_map.at(weight_name);
-  if (!chunk_weight_details.count(chunk_file_name)) {
-    std::cerr << "Error: Chunk file details for '" << chunk_file_name
-              << "' not found." << std::endl;
-    return {};
+// MADV_WILLNEED covers every page the range touches, MADV_DONTNEED only pages
+// entirely inside it, so a neighbour tensor sharing a page keeps it
+void adviseSource(const void *begin, size_t num_bytes, int advice) {
+  uintptr_t page_size = getpagesize();
+  uintptr_t start = (uintptr_t)begin, end = start + num_bytes;
+  if (advice == MADV_DONTNEED) {
+    start = (start + page_size - 1) & ~(page_size - 1);
+    end &= ~(page_size - 1);
+  } else {
+    start &= ~(page_size - 1);
+  }
+  if (end > start) {
+    madvise((void *)start, end - start, advice);
   }
+}
 
-  const auto &weight_list = chunk_weight_details.at(chunk_file_name);
-  nlohmann::json weight_info;
-  bool found = false;
-  for (const auto &wd : weight_list) {
-    if (wd["name"].get<std::string>() == weight_name) {
-      weight_info = wd;
-      found = true;
-      break;
+bool pwriteFully(int fd, const void *data, size_t num_bytes, off_t offset) {
+  const char *ptr = static_cast<const char *>(data);
+  while (num_bytes > 0) {
+    ssize_t written = pwrite(fd, ptr, num_bytes, offset);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
     }
+    ptr += written;
+    offset += written;
+    num_bytes -= written;
   }
+  return true;
+}
 
-  if (!found) {
-    std::cerr << "Error: Details for weight '" << weight_name
-              << "' not found in chunk details." << std::endl;
-    return {};
+// resume maps the file left by an interrupted run, its header has to be the
+// one this run would write
+bool openHugetlbOutput(const std::string &path, const std::string &prefix,
+                       uint64_t data_size, bool resume, HugetlbOutput &out) {
+  int fd = open(path.c_str(), resume ? O_RDWR : O_CREAT | O_EXCL | O_RDWR,
+                0666);
+  if (fd == -1) {
+    std::cerr << "Error: Could not " << (resume ? "open" : "create")
+              << " hugetlbfs output " << path << ": " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  // hugetlbfs reports its huge page size as block size, mapping length must
+  // be a multiple of it
+  struct statfs fs;
+  uint64_t page_size = fstatfs(fd, &fs) == 0 ? fs.f_bsize : 2097152;
+  out.data_start = prefix.size();
+  uint64_t file_size = out.data_start + data_size;
+  out.mapped_size = (file_size + page_size - 1) / page_size * page_size;
+  void *ptr = mmap(NULL, out.mapped_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_HUGETLB, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    std::cerr << "Error: mmap of hugetlbfs output " << path << " with "
+              << out.mapped_size << " bytes failed: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  out.base = static_cast<char *>(ptr);
+  if (!resume) {
+    memcpy(out.base, prefix.data(), prefix.size());
+  } else if (memcmp(out.base, prefix.data(), prefix.size()) != 0) {
+    std::cerr << "Error: " << path
+              << " has another header than this conversion, can't resume."
+              << std::endl;
+    closeHugetlbOutput(out);
+    return false;
   }
+  std::cout << "Mapped hugetlbfs output " << path << ": " << file_size
+            << " bytes in " << out.mapped_size / page_size << " pages of "
+            << page_size << " bytes" << std::endl;
+  return true;
+}
 
-  std::string dtype_str = weight_info["dtype"].get<std::string>();
-  std::vector<long long> shape =
-      weight_info["shape"].get<std::vector<long long>>();
-  std::vector<int64_t> data_offsets =
-      weight_info["data_offsets"].get<std::vector<int64_t>>();
-  int64_t data_start = data_offsets[0];
-  size_t tensor_num_bytes =
-      (data_offsets.size() > 1 ? data_offsets[1] : 0) - data_start;
-  std::string safetensor_file_path = model_path + "/" + chunk_file_name;
-
-  if (dtype_str == "F8_E4M3" && weight_map.count(weight_name + "_scale_inv")) {
-    std::vector<uint8_t> quantized_data = load_tensor_data<uint8_t>(
-        safetensor_file_path, data_start, tensor_num_bytes);
-
-    std::string scale_name = weight_name + "_scale_inv";
-    std::string scale_file_name;
-    bool scale_file_found = false;
-    for (const auto &[file, details] : chunk_weight_details) {
-      for (const auto &detail : details) {
-        if (detail["name"].get<std::string>() == scale_name) {
-          scale_file_name = file;
-          scale_file_found = true;
-          break;
-        }
-      }
-      if (scale_file_found) {
-        break;
+void closeHugetlbOutput(HugetlbOutput &out) {
+  if (out.base != nullptr) {
+    munmap(out.base, out.mapped_size);
+    out.base = nullptr;
+  }
+}
+
+// Tensors finish in any order with --threads, each piece goes straight to its
+// place in the tensor's data_offsets slot of the presized output
+bool writeTensorPiece(OutputShard &output, const TensorEntry &entry,
+                      uint64_t offset, const void *data, size_t num_bytes) {
+  if (offset + num_bytes > entry.outputBytes()) {
+    // slot stays zero rather than spilling into the next tensor
+    std::cerr << "Error: Tensor " << entry.name << " has "
+              << offset + num_bytes << " bytes but its slot holds "
+              << entry.outputBytes() << ", not written." << std::endl;
+    return false;
+  }
+  uint64_t position = output.data_start + entry.out_begin + offset;
+  if (output.hugetlb.base != nullptr) {
+    memcpy(output.hugetlb.base + position, data, num_bytes);
+  } else if (!pwriteFully(output.fd, data, num_bytes, position)) {
+    std::cerr << "Error: Writing tensor " << entry.name
+              << " failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Converts an entry whose out_dtype is BF16 (or GGUF Q8_0) one tile of rows
+// at a time: the next tile's source is read ahead, the tile is converted into
+// a buffer (or straight into a mapped output slot) and written, then its
+// source pages are dropped from the mapping. A worker holds about one tile
+// whatever the size of the tensor. The scale of an FP8 weight is linked from
+// the catalog.
+bool convertTensor(const TensorEntry &entry, const TensorCatalog &catalog,
+                   const ShardMap &shards, OutputShard &output) {
+  long long M = entry.shape[0], N = entry.shape[1];
+  TensorSpan<uint8_t> quantized_data;
+  TensorSpan<float> scale_inv_data, float_data;
+  const char *source;
+  bool in_place; // not an aligned copy, pages can be dropped
+  if (entry.dtype == DTYPE_F8_E4M3 && entry.scale != -1) {
+    const TensorEntry &scale = catalog.entries[entry.scale];
+    quantized_data = tensorSpan<uint8_t>(shards, entry);
+    if (scale.dtype == DTYPE_F32) {
+      scale_inv_data = tensorSpan<float>(shards, scale);
+    }
+    if (quantized_data.empty() || scale_inv_data.empty()) {
+      std::cerr << "Warning: Could not dequantize FP8 weight '" << entry.name
+                << "' due to missing data or scale." << std::endl;
+      return false;
+    }
+    source = (const char *)quantized_data.data();
+    in_place = true;
+  } else if (entry.dtype == DTYPE_F32) {
+    float_data = tensorSpan<float>(shards, entry);
+    if (float_data.size() != entry.elements()) {
+      return false;
+    }
+    source = (const char *)float_data.data();
+    in_place = float_data.copy == nullptr;
+  } else {
+    std::cerr << "Warning: Skipping dequantization/conversion for dtype '"
+              << dtype_names[entry.dtype] << "' of weight '" << entry.name
+              << "'." << std::endl;
+    return false;
+  }
+
+  if (M == 0 || N == 0) {
+    return true;
+  }
+  // Q8_0 blocks for GGUF output, BF16 otherwise
+  bool q8_0 = entry.out_ggml_type == GGML_TYPE_Q8_0;
+  size_t source_row = N * dtype_sizes[entry.dtype];
+  size_t output_row = entry.outputBytes() / M;
+  char *slot = output.hugetlb.base == nullptr
+                   ? nullptr
+                   : output.hugetlb.base + output.data_start + entry.out_begin;
+  char *mapped =
+      slot != nullptr && (q8_0 || (uintptr_t)slot % sizeof(bfloat16) == 0)
+          ? slot
+          : nullptr;
+  std::vector<char> tile(mapped ? 0 : std::min(M, tile_rows) * output_row);
+  if (in_place) {
+    adviseSource(source, std::min(M, tile_rows) * source_row, MADV_WILLNEED);
+  }
+  for (long long row = 0; row < M; row += tile_rows) {
+    long long rows = std::min(tile_rows, M - row);
+    if (in_place && row + rows < M) {
+      adviseSource(source + (row + rows) * source_row,
+                   std::min(tile_rows, M - row - rows) * source_row,
+                   MADV_WILLNEED);
+    }
+    char *dst = mapped ? mapped + row * output_row : tile.data();
+    bool converted = true;
+    if (q8_0) {
+      converted = weight_requant_q8_0(quantized_data, scale_inv_data, M, N,
+                                      row, row + rows,
+                                      reinterpret_cast<BlockQ8_0 *>(dst));
+    } else if (entry.dtype == DTYPE_F8_E4M3) {
+      converted = weight_dequant_cpu(quantized_data, scale_inv_data, M, N, row,
+                                     row + rows,
+                                     reinterpret_cast<bfloat16 *>(dst));
+    } else {
+      bfloat16 *bf16_dst = reinterpret_cast<bfloat16 *>(dst);
+      for (long long i = 0; i < rows * N; ++i) {
+        bf16_dst[i] = float_to_bfloat16(float_data[row * N + i]);
       }
     }
+    if (!converted ||
+        (!mapped && !writeTensorPiece(output, entry, row * output_row, dst,
+                                      rows * output_row))) {
+      return false;
+    }
+    if (in_place) {
+      adviseSource(source + row * source_row, rows * source_row,
+                   MADV_DONTNEED);
+    }
+  }
+  return true;
+}
 
-    if (!scale_file_found) {
-      std::cerr << "Error: Chunk file for scale tensor '" << scale_name
-                << "' not found." << std::endl;
-      return {};
+// Widens a 1D BF16 or F16 entry to F32 for GGUF, where norm weights are F32.
+// Such tensors are a few K, converted whole.
+bool widenTensor(const TensorEntry &entry, const ShardMap &shards,
+                 OutputShard &output) {
+  TensorSpan<uint16_t> data = tensorSpan<uint16_t>(shards, entry);
+  if (data.size() != entry.elements()) {
+    return false;
+  }
+  std::vector<float> widened(data.size());
+  for (size_t i = 0; i < data.size(); i++) {
+    widened[i] = entry.dtype == DTYPE_BF16 ? bfloat16_to_float(data[i])
+                                           : half_to_float(data[i]);
+  }
+  return writeTensorPiece(output, entry, 0, widened.data(),
+                          widened.size() * sizeof(float));
+}
+
+// Copies an entry as it is, piece by piece straight from the source mapping
+bool copyTensor(const TensorEntry &entry, const ShardMap &shards,
+                OutputShard &output) {
+  TensorSpan<char> data = tensorSpan<char>(shards, entry);
+  if (data.size() != entry.outputBytes()) {
+    return false;
+  }
+  for (uint64_t offset = 0; offset < data.size(); offset += copy_piece) {
+    size_t len = std::min<uint64_t>(copy_piece, data.size() - offset);
+    adviseSource(data.data() + offset, len, MADV_WILLNEED);
+    if (!writeTensorPiece(output, entry, offset, data.data() + offset, len)) {
+      return false;
     }
+    adviseSource(data.data() + offset, len, MADV_DONTNEED);
+  }
+  return true;
+}
 
-    const auto &scale_list = chunk_weight_details.at(scale_file_name);
-    nlohmann::json scale_info;
-    bool scale_found_in_chunk = false;
-    for (const auto &sd : scale_list) {
-      if (sd["name"].get<std::string>() == scale_name) {
-        scale_info = sd;
-        scale_found_in_chunk = true;
-        break;
-      }
+// What a worker holds while streaming the entry: one tile of source and
+// converted rows, or one copied piece
+uint64_t tileBytes(const TensorEntry &entry) {
+  if (entry.out_dtype == entry.dtype) {
+    return std::min(entry.sourceBytes(), copy_piece);
+  }
+  if (entry.out_dtype == DTYPE_F32) {
+    return entry.sourceBytes() + entry.outputBytes();
+  }
+  uint64_t rows = std::min<uint64_t>(entry.shape[0], tile_rows);
+  if (rows == 0) {
+    return 0;
+  }
+  return rows * (entry.sourceBytes() + entry.outputBytes()) / entry.shape[0];
+}
+
+// Presized output file with its header written, or with --resume the one an
+// interrupted run left, checked to have the same header and size
+bool openOutputFile(const std::string &path, const std::string &prefix,
+                    uint64_t data_size, bool resume, OutputShard &output) {
+  uint64_t file_size = prefix.size() + data_size;
+  if (resume) {
+    output.fd = open(path.c_str(), O_RDWR);
+    struct stat st;
+    std::string existing(prefix.size(), '\0');
+    if (output.fd == -1 || fstat(output.fd, &st) != 0 ||
+        (uint64_t)st.st_size != file_size ||
+        pread(output.fd, existing.data(), existing.size(), 0) !=
+            (ssize_t)existing.size() ||
+        existing != prefix) {
+      std::cerr << "Error: " << path
+                << " is missing or isn't the output of this conversion, "
+                   "can't resume."
+                << std::endl;
+      return false;
     }
-    if (!scale_found_in_chunk) {
-      std::cerr << "Error: Details for scale '" << scale_name
-                << "' not found in chunk details." << std::endl;
-      return {};
+    return true;
+  }
+  output.fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (output.fd == -1 || ftruncate(output.fd, file_size) != 0 ||
+      !pwriteFully(output.fd, prefix.data(), prefix.size(), 0)) {
+    std::cerr << "Error: Could not write output file " << path << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool openJournal(const std::string &path, uint64_t layout_hash,
+                 size_t entry_count, bool resume, ConversionJournal &journal) {
+  JournalHeader header = {};
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.layout_hash = layout_hash;
+  header.entry_count = entry_count;
+  journal.states.assign(entry_count, TENSOR_PENDING);
+  if (resume) {
+    JournalHeader existing;
+    journal.fd = open(path.c_str(), O_RDWR);
+    if (journal.fd == -1 ||
+        pread(journal.fd, &existing, sizeof(existing), 0) !=
+            sizeof(existing) ||
+        memcmp(&existing, &header, sizeof(header)) != 0 ||
+        pread(journal.fd, journal.states.data(), entry_count,
+              sizeof(header)) != (ssize_t)entry_count) {
+      std::cerr << "Error: Journal " << path
+                << " is missing or belongs to another conversion, can't "
+                   "resume."
+                << std::endl;
+      return false;
     }
-    std::vector<int64_t> scale_offsets =
-        scale_info["data_offsets"].get<std::vector<int64_t>>();
-    int64_t scale_start = scale_offsets[0];
-    size_t scale_num_bytes =
-        (scale_offsets.size() > 1 ? scale_offsets[1] : 0) - scale_start;
-    std::vector<float> scale_inv_data = load_tensor_data<float>(
-        model_path + "/" + scale_file_name, scale_start, scale_num_bytes);
-
-    if (!quantized_data.empty() && !scale_inv_data.empty() &&
-        shape.size() == 2) {
-      return weight_dequant_cpu(quantized_data, scale_inv_data, shape[0],
-                                shape[1]);
-    } else {
-      std::cerr << "Warning: Could not dequantize FP8 weight '" << weight_name
-                << "' due to missing data or incorrect shape." << std::endl;
-      return {};
+    return true;
+  }
+  journal.fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (journal.fd == -1 ||
+      ftruncate(journal.fd, sizeof(header) + entry_count) != 0 ||
+      !pwriteFully(journal.fd, &header, sizeof(header), 0) ||
+      fdatasync(journal.fd) != 0) {
+    std::cerr << "Error: Could not write journal " << path << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Records a tensor whose bytes are all written, syncing when the batch is full
+bool journalTensor(ConversionJournal &journal, size_t entry, uint64_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(journal.mutex);
+    journal.batch.push_back(entry);
+    journal.batch_bytes += bytes;
+    if (journal.batch_bytes < journal_batch_bytes &&
+        journal.batch.size() < journal_batch_tensors) {
+      return true;
     }
-  } else if (dtype_str == "BF16") {
-    return load_tensor_data<bfloat16>(safetensor_file_path, data_start,
-                                      tensor_num_bytes);
-  } else if (dtype_str == "float32" || dtype_str == "F32") {
-    std::vector<float> float_data = load_tensor_data<float>(
-        safetensor_file_path, data_start, tensor_num_bytes);
-    std::vector<bfloat16> bf16_data(float_data.size());
-    for (size_t i = 0; i < float_data.size(); ++i) {
-      bf16_data[i] = float_to_bfloat16(float_data[i]);
+  }
+  return syncJournal(journal);
+}
+
+// Output data first, then the states of the batch and the journal itself.
+// hugetlbfs output has nothing to sync, it lives as long as the machine.
+bool syncJournal(ConversionJournal &journal) {
+  std::lock_guard<std::mutex> sync_lock(journal.sync_mutex);
+  std::vector<size_t> batch;
+  {
+    std::lock_guard<std::mutex> lock(journal.mutex);
+    batch.swap(journal.batch);
+    journal.batch_bytes = 0;
+  }
+  if (batch.empty()) {
+    return true;
+  }
+  for (const OutputShard &output : *journal.outputs) {
+    if (output.fd != -1 && fdatasync(output.fd) != 0) {
+      std::cerr << "Error: Syncing output file " << output.name
+                << " failed: " << strerror(errno) << std::endl;
+      return false;
     }
-    return bf16_data;
-  } else {
-    std::cerr << "Warning: Skipping dequantization/conversion for dtype '"
-              << dtype_str << "' of weight '" << weight_name << "'."
+  }
+  uint8_t written = TENSOR_WRITTEN;
+  for (size_t entry : batch) {
+    journal.states[entry] = TENSOR_WRITTEN;
+    if (!pwriteFully(journal.fd, &written, sizeof(written),
+                     sizeof(JournalHeader) + entry)) {
+      std::cerr << "Error: Writing journal failed: " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+  }
+  if (fdatasync(journal.fd) != 0) {
+    std::cerr << "Error: Syncing journal failed: " << strerror(errno)
               << std::endl;
-    return {};
+    return false;
+  }
+  return true;
+}
+
+// model-00001-of-00004.safetensors as HF names them, model.safetensors when
+// output isn't sharded
+std::string outputShardName(size_t shard, size_t shard_count, bool sharded) {
+  if (!sharded) {
+    return "model.safetensors";
   }
+  char name[64];
+  snprintf(name, sizeof(name), "model-%05zu-of-%05zu.safetensors", shard + 1,
+           shard_count);
+  return name;
 }
+
 int main(int argc, char *argv[]) {
-  if (argc < 3 || argc > 4) {
-    std::cerr << "Usage: " << argv[0]
-              << " <input_fp8_path> <output_bf16_path> [--dry-run]"
-              << std::endl;
+  const char *usage =
+      " <input_fp8_path> <output_bf16_path> [--dry-run]\n"
+      "    [--hugetlb-output <hugetlbfs_file|hugetlbfs_dir>] [--threads N]\n"
+      "    [--mem-budget size[K|M|G]] [--shard-size size[K|M|G]]\n"
+      "    [--kernel scalar|avx2|avx512|avx512bf16|auto] [--gguf bf16|q8_0]\n"
+      "    [--resume]";
+  struct option long_options[] = {
+      {"dry-run", no_argument, 0, 'n'},
+      {"hugetlb-output", required_argument, 0, 'H'},
+      {"kernel", required_argument, 0, 'k'},
+      {"threads", required_argument, 0, 't'},
+      {"mem-budget", required_argument, 0, 'm'},
+      {"shard-size", required_argument, 0, 's'},
+      {"gguf", required_argument, 0, 'g'},
+      {"resume", no_argument, 0, 'r'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  bool dry_run = false;
+  std::string hugetlb_path;
+  DequantKernel kernel = best_dequant_kernel();
+  int thread_count = 1;
+  // a tile of the widest DeepSeek-R1 weight is about 7M in and out
+  int64_t mem_budget = 1LL << 30;
+  int64_t shard_size = 0; // single model.safetensors
+  bool gguf = false, gguf_q8_0 = false;
+  bool resume = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "ht:", long_options, nullptr)) !=
+         -1) {
+    switch (opt) {
+    case 'n':
+      dry_run = true;
+      break;
+    case 'H':
+      hugetlb_path = optarg;
+      break;
+    case 'k':
+      kernel = parse_dequant_kernel(optarg);
+      if (kernel == DEQUANT_KERNEL_COUNT || !dequant_kernel_supported(kernel)) {
+        std::cerr << "Error: dequantization kernel " << optarg
+                  << " is unknown or not supported by this cpu." << std::endl;
+        return 1;
+      }
+      break;
+    case 't':
+      thread_count = atoi(optarg);
+      if (thread_count < 1) {
+        std::cerr << "Error: --threads requires a positive number."
+                  << std::endl;
+        return 1;
+      }
+      break;
+    case 'm':
+      mem_budget = parse_size(optarg);
+      if (mem_budget <= 0) {
+        std::cerr << "Error: invalid --mem-budget " << optarg << std::endl;
+        return 1;
+      }
+      break;
+    case 's':
+      shard_size = parse_size(optarg);
+      if (shard_size <= 0) {
+        std::cerr << "Error: invalid --shard-size " << optarg << std::endl;
+        return 1;
+      }
+      break;
+    case 'g':
+      gguf = true;
+      gguf_q8_0 = strcmp(optarg, "q8_0") == 0;
+      if (!gguf_q8_0 && strcmp(optarg, "bf16") != 0) {
+        std::cerr << "Error: --gguf takes bf16 or q8_0." << std::endl;
+        return 1;
+      }
+      break;
+    case 'r':
+      resume = true;
+      break;
+    case 'h':
+      std::cout << "Usage: " << argv[0] << usage << std::endl;
+      return 0;
+    default:
+      std::cerr << "Usage: " << argv[0] << usage << std::endl;
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    std::cerr << "Usage: " << argv[0] << usage << std::endl;
     return 1;
   }
 
-  std::string fp8_path = argv[1];
-  std::string bf16_path = argv[2];
-  bool dry_run = false;
+  std::string fp8_path = argv[optind];
+  std::string bf16_path = argv[optind + 1];
+  dequant_func = dequant_kernel_func(kernel);
+  std::cout << "FP8 dequantization kernel: " << dequant_kernel_names[kernel]
+            << std::endl;
 
-  if (argc == 4 && std::string(argv[3]) == "--dry-run") {
-    dry_run = true;
+  if (dry_run) {
     std::cout << "Dry-run mode enabled. No output files will be written."
               << std::endl;
   }
 
-  // 1. Calculate Metadata
-  auto [final_metadata, chunk_details_map] = calculateMetaDataRevised(fp8_path);
-  if (dry_run) {
-    std::cout << "\n--- Final Metadata (Dry-Run) ---" << std::endl;
-    std::cout << std::setw(4) << final_metadata << std::endl;
+  // 1. Build the tensor catalog and calculate metadata
+  auto catalog_start = std::chrono::steady_clock::now();
+  // headers are small, parsing them is worth every core whatever --threads is
+  int parse_threads =
+      std::max<int>(thread_count, std::thread::hardware_concurrency());
+  TensorCatalog catalog;
+  if (!buildCatalog(fp8_path, parse_threads, shard_size, catalog)) {
+    return 1;
+  }
+  bool sharded = shard_size > 0;
+  GgufModel gguf_model;
+  if (gguf && sharded) {
+    std::cerr << "Error: --gguf writes a single file, not --shard-size."
+              << std::endl;
+    return 1;
+  }
+  // directory name of the model, a trailing '/' leaves filename() empty
+  std::filesystem::path model_dir(fp8_path);
+  if (!model_dir.has_filename()) {
+    model_dir = model_dir.parent_path();
+  }
+  if (gguf &&
+      (!readGgufModel(fp8_path, model_dir.filename().string(), gguf_q8_0,
+                      gguf_model) ||
+       !layoutGguf(catalog, gguf_q8_0, gguf_model))) {
+    return 1;
+  }
+  size_t out_count = catalog.out_sizes.size();
+  std::cout << "Catalog of " << catalog.entries.size() << " tensors in "
+            << catalog.shard_files.size() << " shards built in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             catalog_start)
+                   .count()
+            << "s" << std::endl;
+  if (dry_run && gguf) {
+    nlohmann::json tensors;
+    for (const GgufTensor &tensor : gguf_model.tensors) {
+      tensors[tensor.name] = {{"type", ggmlTypeName(tensor.ggml_type)},
+                              {"shape", tensor.shape},
+                              {"offset", tensor.offset}};
+    }
+    std::cout << "\n--- GGUF tensors of model.gguf (Dry-Run) ---" << std::endl;
+    std::cout << std::setw(4) << tensors << std::endl;
+  } else if (dry_run) {
+    for (size_t i = 0; i < out_count; i++) {
+      std::cout << "\n--- Final Metadata of "
+                << outputShardName(i, out_count, sharded) << " (Dry-Run) ---"
+                << std::endl;
+      std::cout << std::setw(4) << catalogMetadata(catalog, i) << std::endl;
+    }
   }
 
   if (dry_run) { //  with dry-run
@@ -501,102 +893,176 @@ int main(int argc, char *argv[]) {
     return 1; // Indicate an error occurred
   }
 
-  // 2. Prepare Final Result File and Write Metadata
-  std::string metadata_str = final_metadata.dump();
-  uint64_t metadata_len = metadata_str.length();
-  std::string output_file_path = bf16_path + "/model.safetensors";
-  std::ofstream outfile(output_file_path, std::ios::binary);
-  if (!outfile.is_open()) {
-    std::cerr << "Error: Could not open output file " << output_file_path
-              << std::endl;
-    return 1;
+  // 2. Prepare the output shards and write their metadata. Precomputed
+  // offsets tell every shard's full size up front. Sharded hugetlbfs output
+  // goes into a directory there.
+  if (sharded && !hugetlb_path.empty()) {
+    try {
+      std::filesystem::create_directories(hugetlb_path);
+    } catch (const std::filesystem::filesystem_error &e) {
+      std::cerr << "Error creating hugetlbfs output directory '"
+                << hugetlb_path << "': " << e.what() << std::endl;
+      return 1;
+    }
   }
-  outfile.write(reinterpret_cast<const char *>(&metadata_len),
-                sizeof(metadata_len));
-  outfile.write(metadata_str.data(), metadata_len);
-
-  // Load the index once for the initial weight mapping
-  std::string model_index_file = fp8_path + "/model.safetensors.index.json";
-  std::ifstream f_index(model_index_file);
-  nlohmann::json model_index;
-  f_index >> model_index;
-  f_index.close();
-  auto weight_map =
-      model_index["weight_map"].get<std::map<std::string, std::string>>();
-
-  std::cout << "Processing and writing weights..." << std::endl;
-  int weight_counter = 0;
-  int num_weights =
-      final_metadata.size() - (final_metadata.contains("__metadata__") ? 1 : 0);
-
-  for (const auto &[weight_name, tensor_info] : final_metadata.items()) {
-    if (weight_name == "__metadata__") {
-      continue;
+  std::vector<OutputShard> outputs(out_count);
+  std::string layout; // what the journal has to match on --resume
+  for (size_t i = 0; i < out_count; i++) {
+    OutputShard &output = outputs[i];
+    // everything in front of the data section
+    std::string prefix;
+    if (gguf) {
+      output.name = "model.gguf";
+      prefix = ggufHeader(gguf_model);
+    } else {
+      output.name = outputShardName(i, out_count, sharded);
+      std::string metadata_str = catalogMetadata(catalog, i).dump();
+      uint64_t metadata_len = metadata_str.length();
+      prefix.assign(reinterpret_cast<const char *>(&metadata_len),
+                    sizeof(metadata_len));
+      prefix += metadata_str;
     }
-    update_progress((weight_counter++) * 100 / num_weights);
-
-    std::string dtype_str = tensor_info["dtype"].get<std::string>();
-
-    if (dtype_str == "F8_E4M3") {
-      std::vector<bfloat16> bf16_tensor = dequantizeOneweight(
-          weight_name, fp8_path, weight_map, chunk_details_map);
-      if (!bf16_tensor.empty()) {
-        writeOneTensorToFile(outfile, bf16_tensor);
-      } else {
-        std::cerr << "Warning: Skipping writing empty dequantized tensor "
-                  << weight_name << std::endl;
+    output.data_start = prefix.size();
+    layout += prefix;
+    layout.append(reinterpret_cast<const char *>(&catalog.out_sizes[i]),
+                  sizeof(catalog.out_sizes[i]));
+    if (!hugetlb_path.empty()) {
+      std::string path =
+          sharded ? hugetlb_path + "/" + output.name : hugetlb_path;
+      if (!sharded) {
+        output.name = std::filesystem::path(hugetlb_path).filename().string();
       }
-    } else if (dtype_str == "BF16" || dtype_str == "float32" ||
-               dtype_str == "F32") {
-      std::vector<bfloat16> bf16_tensor = dequantizeOneweight(
-          weight_name, fp8_path, weight_map, chunk_details_map);
-      if (!bf16_tensor.empty()) {
-        writeOneTensorToFile(outfile, bf16_tensor);
-      } else {
-        std::cerr << "Warning: Skipping writing empty converted tensor "
-                  << weight_name << std::endl;
-      }
-    } else {
-      // Copy original data for other types
-      if (tensor_info.contains("chunk_file")) {
-        std::string chunk_file_name =
-            tensor_info["chunk_file"].get<std::string>();
-        if (chunk_details_map.count(chunk_file_name)) {
-          const auto &weight_list = chunk_details_map.at(chunk_file_name);
-          for (const auto &wd : weight_list) {
-            if (wd["name"].get<std::string>() == weight_name) {
-              std::vector<int64_t> original_offsets =
-                  wd["data_offsets"].get<std::vector<int64_t>>();
-              int64_t original_start = original_offsets[0];
-              size_t original_num_bytes =
-                  (original_offsets.size() > 1 ? original_offsets[1] : 0) -
-                  original_start;
-              std::vector<char> original_tensor_data =
-                  load_tensor_data<char>(fp8_path + "/" + chunk_file_name,
-                                         original_start, original_num_bytes);
-              writeOneTensorToFile(outfile, original_tensor_data);
-              break;
-            }
-          }
-        }
+      if (!openHugetlbOutput(path, prefix, catalog.out_sizes[i], resume,
+                             output.hugetlb)) {
+        return 1;
       }
+    } else if (!openOutputFile(bf16_path + "/" + output.name, prefix,
+                               catalog.out_sizes[i], resume, output)) {
+      return 1;
     }
   }
+  std::string journal_path = bf16_path + "/q8_bf16.journal";
+  ConversionJournal journal;
+  journal.outputs = &outputs;
+  if (!openJournal(journal_path, hash_tensor_name(layout),
+                   catalog.entries.size(), resume, journal)) {
+    return 1;
+  }
+  std::atomic<bool> write_failed(false);
+  ShardMap shards(catalog.shard_files.size());
+  for (size_t i = 0; i < shards.size(); i++) {
+    if (!openShard(fp8_path + "/" + catalog.shard_files[i], shards[i])) {
+      return 1;
+    }
+  }
+
+  auto process_tensor = [&](size_t index) {
+    const TensorEntry &entry = catalog.entries[index];
+    OutputShard &output = outputs[entry.out_shard];
+    // Everything not converted, BF16 included, is written straight from the
+    // source mapping
+    bool written = entry.out_dtype == entry.dtype
+                       ? copyTensor(entry, shards, output)
+                   : entry.out_dtype == DTYPE_F32
+                       ? widenTensor(entry, shards, output)
+                       : convertTensor(entry, catalog, shards, output);
+    if (!written) {
+      std::cerr << "Error: Could not write tensor " << entry.name << std::endl;
+      write_failed = true;
+    } else if (!journalTensor(journal, index, entry.outputBytes())) {
+      write_failed = true;
+    }
+  };
+
+  // Tensors are taken round robin across output shards, so with several
+  // threads each shard is filled front to back while all of them are being
+  // written at the same time
+  std::vector<size_t> order;
+  std::vector<size_t> rank(catalog.entries.size());
+  std::vector<size_t> shard_fill(out_count, 0);
+  for (size_t i = 0; i < catalog.entries.size(); i++) {
+    if (!catalog.entries[i].dropped &&
+        journal.states[i] != TENSOR_WRITTEN) {
+      order.push_back(i);
+      rank[i] = shard_fill[catalog.entries[i].out_shard]++;
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return rank[a] < rank[b]; });
+
+  if (resume) {
+    std::cout << "Resuming, " << order.size() << " tensors left to write."
+              << std::endl;
+  }
+  std::cout << "Processing and writing weights with " << thread_count
+            << " thread(s), at most " << (mem_budget >> 20)
+            << "M in flight..." << std::endl;
+  MemoryBudget budget(mem_budget);
+  std::atomic<size_t> next_task(0);
+  std::mutex progress_mutex;
+  size_t tensors_done = 0;
+  update_progress(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next_task++) < order.size();) {
+      const TensorEntry &entry = catalog.entries[order[i]];
+      uint64_t bytes = tileBytes(entry);
+      budget.acquire(bytes);
+      process_tensor(order[i]);
+      budget.release(bytes);
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      update_progress(++tensors_done * 100 / order.size());
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < thread_count; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
   std::cout << "\nFinished writing weight data." << std::endl;
-  outfile.close();
-
-  // Create the new index file
-  nlohmann::json new_index_json;
-  new_index_json["weight_map"] = nlohmann::json::object();
-  for (const auto &item : final_metadata.items()) {
-    if (item.key() != "__metadata__") {
-      new_index_json["weight_map"][item.key()] = "model.safetensors";
+  if (!syncJournal(journal)) {
+    write_failed = true;
+  }
+  for (auto &shard : shards) {
+    closeShard(shard);
+  }
+  for (OutputShard &output : outputs) {
+    if (output.hugetlb.base != nullptr) {
+      closeHugetlbOutput(output.hugetlb);
+    } else if (close(output.fd) != 0) {
+      std::cerr << "Error: Closing output file " << output.name
+                << " failed: " << strerror(errno) << std::endl;
+      write_failed = true;
     }
   }
+  close(journal.fd);
+  if (write_failed) {
+    std::cerr << "Error: Some tensors could not be written, rerun with "
+                 "--resume to write only those."
+              << std::endl;
+    return 1;
+  }
 
-  std::ofstream index_outfile(bf16_path + "/model.safetensors.index.json");
-  index_outfile << std::setw(4) << new_index_json << std::endl;
-  index_outfile.close();
+  // Create the new index file, with hugetlbfs output it still goes to the
+  // output directory and weight names map to the hugetlbfs files. GGUF
+  // carries its own tensor index.
+  if (!gguf) {
+    nlohmann::json new_index_json;
+    new_index_json["metadata"] = {
+        {"total_size", std::accumulate(catalog.out_sizes.begin(),
+                                       catalog.out_sizes.end(), (uint64_t)0)}};
+    new_index_json["weight_map"] = nlohmann::json::object();
+    for (const TensorEntry &entry : catalog.entries) {
+      new_index_json["weight_map"][entry.name] = outputs[entry.out_shard].name;
+    }
+
+    std::ofstream index_outfile(bf16_path + "/model.safetensors.index.json");
+    index_outfile << std::setw(4) << new_index_json << std::endl;
+    index_outfile.close();
+  }
+  // every tensor is in place, nothing left to resume
+  unlink(journal_path.c_str());
 
   std::cout << "Dequantization and merging complete. BF16 model saved to "
             << bf16_path << std::endl;
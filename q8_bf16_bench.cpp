@@ -0,0 +1,824 @@
+// Benchmark and correctness harness of q8_bf16. A synthetic FP8 model
+// directory (index, shards, _scale_inv tensors, BF16, F32, I64 and 3D
+// tensors) is generated when the model doesn't exist, so no 700G checkpoint
+// is needed. Every dequantization kernel is timed alone over DeepSeek shaped
+// rows, and with --q8-bf16 the converter is timed end to end. Both results
+// are checked value by value against a reference E4M3 decoder which shares
+// nothing with dequant_kernel.h. One json line per run, like hugecp_bench.
+#include "dequant_kernel.h"
+#include "tensor_catalog.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <getopt.h>
+#include <vector>
+
+// DeepSeek's 128x128 scale blocks
+static const long long block_size = 128;
+// columns of the kernel benchmark matrix, DeepSeek V3 hidden size
+static const long long kernel_columns = 7168;
+// generated tensors are written in pieces of this size
+static const size_t generate_piece = 16 << 20;
+// mismatches printed per run, the rest are only counted
+static const int reported_mismatches = 5;
+
+// Reference decoder built from the E4M3 bit layout alone: normal values get
+// their exponent rebiased by 127 - 7 in float bits, subnormals are m / 512
+float reference_e4m3(uint8_t v) {
+  uint32_t sign = (uint32_t)(v >> 7) << 31;
+  uint32_t exponent = (v >> 3) & 0xf, mantissa = v & 0x7;
+  if (exponent == 0xf && mantissa == 0x7) {
+    return NAN;
+  }
+  float value;
+  if (exponent == 0) {
+    value = mantissa / 512.0f;
+    return sign ? -value : value;
+  }
+  uint32_t bits = sign | (exponent + 120) << 23 | mantissa << 20;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// magnitude past the largest finite bfloat16, where inf stands in for 2^128
+double reference_bfloat16_value(bfloat16 bf) {
+  if ((bf & 0x7fff) == 0x7f80) {
+    return (bf & 0x8000 ? -1 : 1) * std::ldexp(1.0, 128);
+  }
+  return bfloat16_to_float(bf);
+}
+
+// Nearest bfloat16 picked by comparing both neighbours in double, ties go to
+// the even one. Not the bit trick the kernels use on purpose.
+bfloat16 reference_bfloat16(float f) {
+  if (std::isnan(f)) {
+    return 0x7fc0;
+  }
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  bfloat16 toward_zero = bits >> 16;
+  if (std::isinf(f) || (bits & 0xffff) == 0) {
+    return toward_zero;
+  }
+  bfloat16 away = toward_zero + 1;
+  double below = std::fabs(f - reference_bfloat16_value(toward_zero));
+  double above = std::fabs(reference_bfloat16_value(away) - f);
+  if (below != above) {
+    return below < above ? toward_zero : away;
+  }
+  return toward_zero & 1 ? away : toward_zero;
+}
+
+bool is_bfloat16_nan(bfloat16 bf) { return (bf & 0x7fff) > 0x7f80; }
+
+// any NaN matches any NaN, kernels only promise to keep it a NaN
+bool bfloat16_matches(bfloat16 got, bfloat16 expected) {
+  return got == expected || (is_bfloat16_nan(got) && is_bfloat16_nan(expected));
+}
+
+// Deterministic stream, a tensor seeded by its name generates the same data
+// on every box
+struct XorShift {
+  uint64_t state;
+  explicit XorShift(uint64_t seed) : state(seed | 1) {}
+  uint64_t next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+  // [0, 1)
+  float uniform() { return (next() >> 40) / 16777216.0f; }
+};
+
+// dequantization factor in the range real checkpoints use
+float synthetic_scale(XorShift &random) {
+  return 1e-4f + random.uniform() * 1e-2f;
+}
+
+struct SyntheticTensor {
+  std::string name;
+  DType dtype;
+  std::vector<int64_t> shape;
+
+  uint64_t bytes() const {
+    uint64_t count = dtype_sizes[dtype];
+    for (int64_t dim : shape) {
+      count *= dim;
+    }
+    return count;
+  }
+};
+
+void addWeight(std::vector<SyntheticTensor> &tensors, const std::string &name,
+               int64_t rows, int64_t columns) {
+  tensors.push_back({name, DTYPE_F8_E4M3, {rows, columns}});
+  tensors.push_back({name + "_scale_inv",
+                     DTYPE_F32,
+                     {(rows + block_size - 1) / block_size,
+                      (columns + block_size - 1) / block_size}});
+}
+
+// One decoder layer. The MLP is 2 * hidden + 64 wide so its weights end in
+// partial scale blocks both ways. The router weight is 2D F32 and is
+// converted too, its bias is 1D F32 and the packed experts are 3D FP8
+// without a scale, which are copied as they are.
+std::vector<SyntheticTensor> syntheticLayer(int layer, int64_t hidden) {
+  std::string prefix = "model.layers." + std::to_string(layer) + ".";
+  int64_t intermediate = 2 * hidden + 64;
+  std::vector<SyntheticTensor> tensors;
+  tensors.push_back({prefix + "input_layernorm.weight", DTYPE_BF16, {hidden}});
+  addWeight(tensors, prefix + "self_attn.q_proj.weight", hidden, hidden);
+  addWeight(tensors, prefix + "mlp.gate_proj.weight", intermediate, hidden);
+  addWeight(tensors, prefix + "mlp.down_proj.weight", hidden, intermediate);
+  tensors.push_back({prefix + "mlp.gate.weight", DTYPE_F32, {8, hidden}});
+  tensors.push_back(
+      {prefix + "mlp.gate.e_score_correction_bias", DTYPE_F32, {8}});
+  tensors.push_back(
+      {prefix + "mlp.experts_packed.weight", DTYPE_F8_E4M3, {2, 64, hidden}});
+  tensors.push_back(
+      {prefix + "self_attn.rotary_positions", DTYPE_I64, {64}});
+  return tensors;
+}
+
+// Fills len bytes of tensor from byte offset on, random carries on from the
+// previous piece which always ends on a whole element
+void syntheticData(const SyntheticTensor &tensor, XorShift &random,
+                   char *dst, size_t len, uint64_t offset) {
+  bool scale = tensor.name.size() > 10 &&
+               tensor.name.compare(tensor.name.size() - 10, 10,
+                                   "_scale_inv") == 0;
+  size_t element_size = dtype_sizes[tensor.dtype];
+  for (size_t i = 0; i < len; i += element_size) {
+    switch (tensor.dtype) {
+    case DTYPE_F8_E4M3: {
+      // every byte value, NaN included
+      uint64_t value = random.next();
+      memcpy(dst + i, &value, std::min<size_t>(sizeof(value), len - i));
+      i += sizeof(value) - element_size;
+      break;
+    }
+    case DTYPE_F32: {
+      float value =
+          scale ? synthetic_scale(random) : random.uniform() * 2 - 1;
+      memcpy(dst + i, &value, sizeof(value));
+      break;
+    }
+    case DTYPE_BF16: {
+      bfloat16 value = float_to_bfloat16(random.uniform() * 2 - 1);
+      memcpy(dst + i, &value, sizeof(value));
+      break;
+    }
+    default: {
+      int64_t value = (offset + i) / element_size;
+      memcpy(dst + i, &value, sizeof(value));
+      break;
+    }
+    }
+  }
+}
+
+bool writeSyntheticShard(const std::string &path,
+                         std::vector<SyntheticTensor> &tensors) {
+  // widest dtype first keeps every tensor aligned to its element size
+  std::stable_sort(tensors.begin(), tensors.end(),
+                   [](const SyntheticTensor &a, const SyntheticTensor &b) {
+                     return dtype_sizes[a.dtype] > dtype_sizes[b.dtype];
+                   });
+  nlohmann::json metadata;
+  metadata["__metadata__"] = {{"format", "pt"}};
+  uint64_t offset = 0;
+  for (const SyntheticTensor &tensor : tensors) {
+    metadata[tensor.name] = {
+        {"dtype", dtype_names[tensor.dtype]},
+        {"shape", tensor.shape},
+        {"data_offsets", {offset, offset + tensor.bytes()}}};
+    offset += tensor.bytes();
+  }
+  std::string header = metadata.dump();
+  header.resize((header.size() + 7) / 8 * 8, ' ');
+  uint64_t header_len = header.size();
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header_len), sizeof(header_len));
+  out.write(header.data(), header.size());
+  std::vector<char> piece(generate_piece);
+  for (const SyntheticTensor &tensor : tensors) {
+    XorShift random(hash_tensor_name(tensor.name));
+    for (uint64_t done = 0; done < tensor.bytes() && out;
+         done += piece.size()) {
+      size_t len = std::min<uint64_t>(piece.size(), tensor.bytes() - done);
+      syntheticData(tensor, random, piece.data(), len, done);
+      out.write(piece.data(), len);
+    }
+  }
+  if (!out) {
+    std::cerr << "Error: Could not write " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Enough layers for about size bytes, spread over shard_count shards in
+// order, embedding in the first one and norm and lm_head in the last
+bool generateModel(const std::string &model_path, uint64_t size,
+                   int shard_count, int64_t hidden) {
+  const int64_t vocab = 1024;
+  uint64_t layer_bytes = 0;
+  for (const SyntheticTensor &tensor : syntheticLayer(0, hidden)) {
+    layer_bytes += tensor.bytes();
+  }
+  int layers = std::max<uint64_t>(1, size / layer_bytes);
+  shard_count = std::min(shard_count, layers);
+  try {
+    std::filesystem::create_directories(model_path);
+  } catch (const std::filesystem::filesystem_error &e) {
+    std::cerr << "Error creating model directory '" << model_path
+              << "': " << e.what() << std::endl;
+    return false;
+  }
+  std::cerr << "Generating " << layers << " layers of hidden size " << hidden
+            << " in " << shard_count << " shard(s) at " << model_path
+            << std::endl;
+
+  nlohmann::json weight_map;
+  uint64_t total_size = 0;
+  for (int shard = 0; shard < shard_count; shard++) {
+    std::vector<SyntheticTensor> tensors;
+    if (shard == 0) {
+      tensors.push_back(
+          {"model.embed_tokens.weight", DTYPE_BF16, {vocab, hidden}});
+    }
+    for (int layer = shard * layers / shard_count;
+         layer < (shard + 1) * layers / shard_count; layer++) {
+      for (SyntheticTensor &tensor : syntheticLayer(layer, hidden)) {
+        tensors.push_back(std::move(tensor));
+      }
+    }
+    if (shard == shard_count - 1) {
+      tensors.push_back({"model.norm.weight", DTYPE_BF16, {hidden}});
+      tensors.push_back({"lm_head.weight", DTYPE_BF16, {vocab, hidden}});
+    }
+    char file_name[64];
+    snprintf(file_name, sizeof(file_name), "model-%05d-of-%05d.safetensors",
+             shard + 1, shard_count);
+    if (!writeSyntheticShard(model_path + "/" + file_name, tensors)) {
+      return false;
+    }
+    for (const SyntheticTensor &tensor : tensors) {
+      weight_map[tensor.name] = file_name;
+      total_size += tensor.bytes();
+    }
+  }
+  nlohmann::json index = {{"metadata", {{"total_size", total_size}}},
+                          {"weight_map", weight_map}};
+  std::ofstream(model_path + "/model.safetensors.index.json")
+      << index.dump(4) << std::endl;
+  std::ofstream(model_path + "/config.json")
+      << nlohmann::json({{"model_type", "deepseek_v3"}}).dump(4) << std::endl;
+  return true;
+}
+
+// Whole model mapped for checking: every shard of the index and its entries
+struct MappedModel {
+  TensorCatalog catalog;
+  std::vector<const char *> data; // data section of every shard
+  std::vector<std::pair<void *, size_t>> mappings;
+  std::unordered_map<std::string, size_t> names;
+
+  ~MappedModel() {
+    for (auto &[base, size] : mappings) {
+      munmap(base, size);
+    }
+  }
+  const char *tensorData(const TensorEntry &entry) const {
+    return data[entry.shard] + entry.begin;
+  }
+};
+
+bool mapModel(const std::string &model_path, MappedModel &model) {
+  std::string index_path = model_path + "/model.safetensors.index.json";
+  std::map<std::string, std::string> weight_map;
+  try {
+    std::ifstream f(index_path);
+    weight_map = nlohmann::json::parse(f)
+                     .at("weight_map")
+                     .get<std::map<std::string, std::string>>();
+  } catch (const nlohmann::json::exception &e) {
+    std::cerr << "Error parsing " << index_path << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  std::map<std::string, uint32_t> shard_ids;
+  for (const auto &[name, file_name] : weight_map) {
+    shard_ids.emplace(file_name, shard_ids.size());
+  }
+  model.data.resize(shard_ids.size());
+  for (const auto &[file_name, id] : shard_ids) {
+    std::string path = model_path + "/" + file_name;
+    if (!parseShardHeader(path, id, model.catalog.entries)) {
+      return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    if (fd != -1 && fstat(fd, &st) == 0) {
+      ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    if (ptr == MAP_FAILED) {
+      std::cerr << "Error: mmap of " << path << " failed: " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+    model.mappings.emplace_back(ptr, st.st_size);
+    uint64_t header_len;
+    memcpy(&header_len, ptr, sizeof(header_len));
+    model.data[id] = static_cast<const char *>(ptr) + sizeof(header_len) +
+                     header_len;
+  }
+  for (size_t i = 0; i < model.catalog.entries.size(); i++) {
+    model.names.emplace(model.catalog.entries[i].name, i);
+  }
+  return true;
+}
+
+// Counts mismatching values, reporting the first few
+struct MismatchLog {
+  std::atomic<uint64_t> count{0};
+  std::mutex mutex;
+
+  void add(const std::string &name, uint64_t index, bfloat16 got,
+           bfloat16 expected) {
+    if (count++ < reported_mismatches) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::cerr << "Mismatch: " << name << "[" << index << "] is 0x"
+                << std::hex << got << " instead of 0x" << expected << std::dec
+                << std::endl;
+    }
+  }
+  void add(const std::string &name, const std::string &what) {
+    if (count++ < reported_mismatches) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::cerr << "Mismatch: " << name << " " << what << std::endl;
+    }
+  }
+};
+
+// Checks one source tensor against the output. FP8 weights with a scale
+// tensor and 2D F32 become BF16 as the reference computes them, everything
+// else has to be the same bytes.
+void checkTensor(const MappedModel &source, const MappedModel &output,
+                 const TensorEntry &entry, MismatchLog &log) {
+  auto found = output.names.find(entry.name);
+  if (found == output.names.end()) {
+    log.add(entry.name, "is missing from the output");
+    return;
+  }
+  const TensorEntry &converted = output.catalog.entries[found->second];
+  auto scale = source.names.find(entry.name + "_scale_inv");
+  bool dequantized = entry.dtype == DTYPE_F8_E4M3 && entry.shape.size() == 2 &&
+                     scale != source.names.end();
+  bool narrowed = entry.dtype == DTYPE_F32 && entry.shape.size() == 2;
+  DType expected_dtype = dequantized || narrowed ? DTYPE_BF16 : entry.dtype;
+  if (converted.dtype != expected_dtype || converted.shape != entry.shape) {
+    log.add(entry.name, std::string("is ") + dtype_names[converted.dtype] +
+                            " instead of " + dtype_names[expected_dtype] +
+                            " or has another shape");
+    return;
+  }
+  const char *src = source.tensorData(entry);
+  const char *dst = output.tensorData(converted);
+  if (!dequantized && !narrowed) {
+    if (memcmp(src, dst, entry.sourceBytes()) != 0) {
+      log.add(entry.name, "differs from the source");
+    }
+    return;
+  }
+  uint64_t elements = entry.elements();
+  long long columns = entry.shape[1];
+  long long column_blocks = (columns + block_size - 1) / block_size;
+  const TensorEntry *scale_entry =
+      dequantized ? &source.catalog.entries[scale->second] : nullptr;
+  if (dequantized &&
+      scale_entry->elements() <
+          (uint64_t)((entry.shape[0] + block_size - 1) / block_size *
+                     column_blocks)) {
+    log.add(entry.name, "has too few scales");
+    return;
+  }
+  for (uint64_t i = 0; i < elements; i++) {
+    float value;
+    if (dequantized) {
+      long long row = i / columns, column = i % columns;
+      float factor;
+      memcpy(&factor,
+             source.tensorData(*scale_entry) +
+                 ((row / block_size) * column_blocks + column / block_size) *
+                     sizeof(float),
+             sizeof(factor));
+      value = reference_e4m3(src[i]) * factor;
+    } else {
+      memcpy(&value, src + i * sizeof(float), sizeof(value));
+    }
+    bfloat16 got;
+    memcpy(&got, dst + i * sizeof(got), sizeof(got));
+    bfloat16 expected = reference_bfloat16(value);
+    if (!bfloat16_matches(got, expected)) {
+      log.add(entry.name, i, got, expected);
+    }
+  }
+}
+
+// Mismatches of the converted output against the source, -1 if either can't
+// be read. Tensors are checked by every core.
+int64_t checkConversion(const std::string &model_path,
+                        const std::string &output_path) {
+  MappedModel source, output;
+  if (!mapModel(model_path, source) || !mapModel(output_path, output)) {
+    return -1;
+  }
+  MismatchLog log;
+  if (output.catalog.entries.size() != source.catalog.entries.size()) {
+    log.add(output_path, "holds " +
+                             std::to_string(output.catalog.entries.size()) +
+                             " tensors instead of " +
+                             std::to_string(source.catalog.entries.size()));
+  }
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> checkers;
+  for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency());
+       i++) {
+    checkers.emplace_back([&] {
+      for (size_t j = next++; j < source.catalog.entries.size(); j = next++) {
+        checkTensor(source, output, source.catalog.entries[j], log);
+      }
+    });
+  }
+  for (auto &t : checkers) {
+    t.join();
+  }
+  return log.count;
+}
+
+double timeval_seconds(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Times one kernel over a rows x 7168 matrix the way weight_dequant_cpu
+// walks it, 128 wide runs of a row sharing a block scale, rows split over
+// threads. The first run is checked against the reference, false on any
+// mismatch.
+bool benchKernel(DequantKernel kernel, int threads, uint64_t size,
+                 int repeat) {
+  long long rows = std::max<long long>(1, size / kernel_columns);
+  long long column_blocks = kernel_columns / block_size;
+  std::vector<uint8_t> src(rows * kernel_columns);
+  std::vector<float> scales((rows + block_size - 1) / block_size *
+                            column_blocks);
+  std::vector<bfloat16> dst(src.size());
+  XorShift random(hash_tensor_name(dequant_kernel_names[kernel]));
+  for (uint8_t &q : src) {
+    q = random.next() >> 56;
+  }
+  for (float &scale : scales) {
+    scale = synthetic_scale(random);
+  }
+  DequantFunc dequant = dequant_kernel_func(kernel);
+  bool matched = true;
+
+  auto convertRows = [&](long long row_begin, long long row_end) {
+    for (long long row = row_begin; row < row_end; row++) {
+      const float *row_scales = &scales[(row / block_size) * column_blocks];
+      for (long long block = 0; block < column_blocks; block++) {
+        long long offset = row * kernel_columns + block * block_size;
+        dequant(&src[offset], &dst[offset], block_size, row_scales[block]);
+      }
+    }
+  };
+
+  for (int r = 0; r < repeat; r++) {
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back(convertRows, rows * t / threads,
+                           rows * (t + 1) / threads);
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count();
+    uint64_t mismatches = 0;
+    if (r == 0) {
+      MismatchLog log;
+      for (size_t i = 0; i < src.size(); i++) {
+        long long row = i / kernel_columns, column = i % kernel_columns;
+        float scale =
+            scales[(row / block_size) * column_blocks + column / block_size];
+        bfloat16 expected = reference_bfloat16(reference_e4m3(src[i]) * scale);
+        if (!bfloat16_matches(dst[i], expected)) {
+          log.add(dequant_kernel_names[kernel], i, dst[i], expected);
+        }
+      }
+      mismatches = log.count;
+      matched = mismatches == 0;
+    }
+    nlohmann::json result = {{"bench", "kernel"},
+                             {"kernel", dequant_kernel_names[kernel]},
+                             {"threads", threads},
+                             {"run", r},
+                             {"bytes", src.size()},
+                             {"seconds", seconds},
+                             {"gbps", src.size() / seconds / 1e9},
+                             {"checked", r == 0},
+                             {"mismatches", mismatches}};
+    std::cout << result.dump() << std::endl;
+  }
+  return matched;
+}
+
+// drop source shards from page cache so the run reads from the device
+void dropModelCache(const std::string &model_path) {
+  for (const auto &file : std::filesystem::directory_iterator(model_path)) {
+    int fd = open(file.path().c_str(), O_RDONLY);
+    if (fd != -1) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+}
+
+// Runs q8_bf16 on the model into a fresh directory under output_root, its
+// own output goes to q8_bf16_bench.log there. Then checks the result and
+// removes it. false if the conversion failed or didn't match.
+bool benchConversion(const std::string &q8_bf16, const std::string &model_path,
+                     const std::string &output_root, DequantKernel kernel,
+                     int threads, bool cold, int repeat) {
+  std::string output_path =
+      output_root + "/q8_bf16_bench." + std::to_string(getpid());
+  std::string log_path = output_root + "/q8_bf16_bench.log";
+  uint64_t source_bytes = 0;
+  {
+    MappedModel model;
+    if (!mapModel(model_path, model)) {
+      return false;
+    }
+    for (const TensorEntry &entry : model.catalog.entries) {
+      source_bytes += entry.sourceBytes();
+    }
+  }
+  std::string thread_arg = std::to_string(threads);
+  std::vector<const char *> args = {q8_bf16.c_str(),
+                                    model_path.c_str(),
+                                    output_path.c_str(),
+                                    "--threads",
+                                    thread_arg.c_str(),
+                                    "--kernel",
+                                    dequant_kernel_names[kernel],
+                                    nullptr};
+  for (int r = 0; r < repeat; r++) {
+    std::filesystem::remove_all(output_path);
+    if (cold) {
+      dropModelCache(model_path);
+    }
+    auto begin = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      int fd = open(log_path.c_str(), O_CREAT | O_APPEND | O_WRONLY, 0644);
+      if (fd != -1) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+      }
+      execv(q8_bf16.c_str(), const_cast<char *const *>(args.data()));
+      _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (pid == -1 || wait4(pid, &status, 0, &usage) != pid) {
+      std::cerr << "Error: Could not run " << q8_bf16 << ": "
+                << strerror(errno) << std::endl;
+      return false;
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cerr << "Error: " << q8_bf16 << " failed with status " << status
+                << ", see " << log_path << std::endl;
+      return false;
+    }
+    int64_t mismatches = checkConversion(model_path, output_path);
+    std::filesystem::remove_all(output_path);
+    nlohmann::json result = {
+        {"bench", "convert"},
+        {"kernel", dequant_kernel_names[kernel]},
+        {"threads", threads},
+        {"cold", cold},
+        {"run", r},
+        {"bytes", source_bytes},
+        {"seconds", seconds},
+        {"gbps", source_bytes / seconds / 1e9},
+        {"cpu_user", timeval_seconds(usage.ru_utime)},
+        {"cpu_sys", timeval_seconds(usage.ru_stime)},
+        {"mismatches", mismatches}};
+    std::cout << result.dump() << std::endl;
+    if (mismatches != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<std::string> split_list(const char *str) {
+  std::vector<std::string> items;
+  std::string item;
+  for (const char *p = str;; p++) {
+    if (*p == ',' || *p == '\0') {
+      if (!item.empty()) {
+        items.push_back(item);
+      }
+      item.clear();
+      if (*p == '\0') {
+        break;
+      }
+    } else {
+      item += *p;
+    }
+  }
+  return items;
+}
+
+int main(int argc, char *argv[]) {
+  const char *usage =
+      " -i <model_dir> [--size 1G] [--shards 4] [--hidden 2048]\n"
+      "    [--kernel name,...] [--kernel-size 256M] [--threads 1,8,...]\n"
+      "    [--repeat N] [--q8-bf16 <q8_bf16 binary> -o <output_dir>] "
+      "[--cold]\n"
+      "  model_dir is generated when missing, kernels are "
+      "scalar avx2 avx512 avx512bf16\n"
+      "  (default every supported one), --q8-bf16 also times whole "
+      "conversions into output_dir";
+  struct option long_options[] = {
+      {"model", required_argument, 0, 'i'},
+      {"size", required_argument, 0, 's'},
+      {"shards", required_argument, 0, 'S'},
+      {"hidden", required_argument, 0, 'H'},
+      {"kernel", required_argument, 0, 'k'},
+      {"kernel-size", required_argument, 0, 'K'},
+      {"threads", required_argument, 0, 't'},
+      {"repeat", required_argument, 0, 'r'},
+      {"q8-bf16", required_argument, 0, 'q'},
+      {"output", required_argument, 0, 'o'},
+      {"cold", no_argument, 0, 'c'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  std::string model_path, q8_bf16, output_path;
+  int64_t size = 1LL << 30;
+  int64_t kernel_size = 256LL << 20;
+  int shard_count = 4;
+  int64_t hidden = 2048;
+  std::vector<DequantKernel> kernels;
+  std::vector<int> thread_counts;
+  int repeat = 1;
+  bool cold = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hi:o:t:", long_options, nullptr)) !=
+         -1) {
+    switch (opt) {
+    case 'i':
+      model_path = optarg;
+      break;
+    case 's':
+    case 'K':
+      if (parse_size(optarg) <= 0) {
+        std::cerr << "Error: invalid size " << optarg << "." << std::endl;
+        return 1;
+      }
+      (opt == 's' ? size : kernel_size) = parse_size(optarg);
+      break;
+    case 'S':
+      shard_count = atoi(optarg);
+      if (shard_count < 1) {
+        std::cerr << "Error: --shards requires a positive number."
+                  << std::endl;
+        return 1;
+      }
+      break;
+    case 'H':
+      hidden = atoll(optarg);
+      if (hidden < block_size || hidden % 64 != 0) {
+        std::cerr << "Error: --hidden has to be a multiple of 64, at least "
+                  << block_size << "." << std::endl;
+        return 1;
+      }
+      break;
+    case 'k':
+      for (const std::string &name : split_list(optarg)) {
+        DequantKernel kernel = parse_dequant_kernel(name.c_str());
+        if (kernel == DEQUANT_KERNEL_COUNT) {
+          std::cerr << "Error: unknown kernel " << name << "." << std::endl;
+          return 1;
+        }
+        kernels.push_back(kernel);
+      }
+      break;
+    case 't':
+      for (const std::string &item : split_list(optarg)) {
+        if (atoi(item.c_str()) < 1) {
+          std::cerr << "Error: --threads requires positive numbers."
+                    << std::endl;
+          return 1;
+        }
+        thread_counts.push_back(atoi(item.c_str()));
+      }
+      break;
+    case 'r':
+      repeat = std::max(1, atoi(optarg));
+      break;
+    case 'q':
+      q8_bf16 = optarg;
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'c':
+      cold = true;
+      break;
+    case 'h':
+      std::cout << "Usage: " << argv[0] << usage << std::endl;
+      return 0;
+    default:
+      std::cerr << "Usage: " << argv[0] << usage << std::endl;
+      return 1;
+    }
+  }
+  if (model_path.empty() || q8_bf16.empty() != output_path.empty()) {
+    std::cerr << "Error: -i is required, --q8-bf16 and -o go together."
+              << std::endl;
+    std::cerr << "Usage: " << argv[0] << usage << std::endl;
+    return 1;
+  }
+  if (kernels.empty()) {
+    for (int i = 0; i < DEQUANT_KERNEL_COUNT; i++) {
+      kernels.push_back((DequantKernel)i);
+    }
+  }
+  if (thread_counts.empty()) {
+    // one cpu box would run everything twice at 1 thread
+    thread_counts = {1};
+    if (std::thread::hardware_concurrency() > 1) {
+      thread_counts.push_back(std::thread::hardware_concurrency());
+    }
+  }
+
+  if (!std::filesystem::exists(model_path) &&
+      !generateModel(model_path, size, shard_count, hidden)) {
+    return 2;
+  }
+
+  bool failed = false;
+  for (DequantKernel kernel : kernels) {
+    if (!dequant_kernel_supported(kernel)) {
+      std::cerr << "Skip " << dequant_kernel_names[kernel]
+                << ", not supported by this cpu." << std::endl;
+      continue;
+    }
+    for (int threads : thread_counts) {
+      if (!benchKernel(kernel, threads, kernel_size, repeat)) {
+        failed = true;
+      }
+    }
+    if (q8_bf16.empty()) {
+      continue;
+    }
+    for (int threads : thread_counts) {
+      if (!benchConversion(q8_bf16, model_path, output_path, kernel, threads,
+                           cold, repeat)) {
+        failed = true;
+      }
+    }
+  }
+  return failed ? 3 : 0;
+}
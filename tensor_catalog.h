@@ -0,0 +1,374 @@
+// Typed tensor catalog of a safetensors model used by q8_bf16.cpp.
+// Shard headers are parsed once, in parallel, into flat entries found through
+// an open addressed hash, so converting a tensor never walks json: its dtype,
+// shape, shard, offsets and scale tensor are one lookup away. json is only
+// used to read the headers and the index and to write the output header.
+#ifndef Q8_TENSOR_CATALOG_H
+#define Q8_TENSOR_CATALOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum DType : uint8_t {
+  DTYPE_BOOL,
+  DTYPE_U8,
+  DTYPE_I8,
+  DTYPE_F8_E5M2,
+  DTYPE_F8_E4M3,
+  DTYPE_I16,
+  DTYPE_U16,
+  DTYPE_F16,
+  DTYPE_BF16,
+  DTYPE_I32,
+  DTYPE_U32,
+  DTYPE_F32,
+  DTYPE_F64,
+  DTYPE_I64,
+  DTYPE_U64,
+  DTYPE_COUNT
+};
+
+static const char *dtype_names[DTYPE_COUNT] = {
+    "BOOL", "U8",  "I8",   "F8_E5M2", "F8_E4M3", "I16", "U16", "F16",
+    "BF16", "I32", "U32", "F32",     "F64",     "I64", "U64"};
+
+static const uint8_t dtype_sizes[DTYPE_COUNT] = {1, 1, 1, 1, 1, 2, 2, 2,
+                                                 2, 4, 4, 4, 8, 8, 8};
+
+// size with optional K, M or G suffix, -1 when invalid
+inline int64_t parse_size(const char *str) {
+  char *end;
+  double value = strtod(str, &end);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= 1024;
+    break;
+  case 'm':
+  case 'M':
+    value *= 1024 * 1024;
+    break;
+  case 'g':
+  case 'G':
+    value *= 1024 * 1024 * 1024;
+    break;
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+  return value > 0 ? (int64_t)value : -1;
+}
+
+// DTYPE_COUNT if unknown, "float32" is still taken for F32
+inline DType parse_dtype(const std::string &name) {
+  if (name == "float32") {
+    return DTYPE_F32;
+  }
+  for (int i = 0; i < DTYPE_COUNT; i++) {
+    if (name == dtype_names[i]) {
+      return (DType)i;
+    }
+  }
+  return DTYPE_COUNT;
+}
+
+struct TensorEntry {
+  std::string name;
+  std::vector<int64_t> shape;
+  DType dtype = DTYPE_COUNT;
+  uint32_t shard = 0;  // index into TensorCatalog::shard_files
+  uint64_t begin = 0;  // data_offsets in the source shard
+  uint64_t end = 0;
+  int32_t scale = -1;  // entry of name + "_scale_inv", -1 without one
+  DType out_dtype = DTYPE_COUNT; // differs from dtype when converted
+  uint32_t out_shard = 0;        // index into TensorCatalog::out_sizes
+  uint64_t out_begin = 0;        // data_offsets in that output shard
+  uint64_t out_end = 0;
+  int32_t out_ggml_type = -1;    // GGUF tensor type, -1 for safetensors
+  bool dropped = false;          // not written, a scale folded into weight
+
+  uint64_t sourceBytes() const { return end - begin; }
+  uint64_t outputBytes() const { return out_end - out_begin; }
+  uint64_t elements() const {
+    uint64_t count = 1;
+    for (int64_t dim : shape) {
+      count *= dim;
+    }
+    return count;
+  }
+};
+
+// FNV-1a, tensor names share long prefixes so every byte has to count
+inline uint64_t hash_tensor_name(const std::string &name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : name) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+struct TensorCatalog {
+  std::vector<std::string> shard_files;
+  std::vector<TensorEntry> entries; // in output order
+  std::vector<uint64_t> out_sizes;  // data section of every output shard
+  std::vector<int32_t> slots;       // entry index, -1 when empty
+
+  // open addressing with linear probing, at most half full
+  void index() {
+    size_t capacity = 16;
+    while (capacity < entries.size() * 2) {
+      capacity *= 2;
+    }
+    slots.assign(capacity, -1);
+    for (size_t i = 0; i < entries.size(); i++) {
+      size_t slot = hash_tensor_name(entries[i].name) & (capacity - 1);
+      while (slots[slot] != -1) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      slots[slot] = i;
+    }
+  }
+
+  // -1 if not in the catalog
+  int32_t find(const std::string &name) const {
+    if (slots.empty()) {
+      return -1;
+    }
+    size_t mask = slots.size() - 1;
+    for (size_t slot = hash_tensor_name(name) & mask; slots[slot] != -1;
+         slot = (slot + 1) & mask) {
+      if (entries[slots[slot]].name == name) {
+        return slots[slot];
+      }
+    }
+    return -1;
+  }
+};
+
+// Reads one shard header into typed entries, checking every dtype, shape and
+// data_offsets against the file so later stages can trust them
+inline bool parseShardHeader(const std::string &path, uint32_t shard,
+                             std::vector<TensorEntry> &entries) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    std::cerr << "Error: Could not open file " << path << ": "
+              << strerror(errno) << std::endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  uint64_t header_len = 0;
+  std::string header;
+  bool read_ok =
+      st.st_size >= (off_t)sizeof(header_len) &&
+      pread(fd, &header_len, sizeof(header_len), 0) == sizeof(header_len) &&
+      header_len <= st.st_size - sizeof(header_len);
+  if (read_ok) {
+    header.resize(header_len);
+    read_ok = pread(fd, header.data(), header_len, sizeof(header_len)) ==
+              (ssize_t)header_len;
+  }
+  close(fd);
+  if (!read_ok) {
+    std::cerr << "Error reading metadata from " << path << std::endl;
+    return false;
+  }
+  uint64_t data_size = st.st_size - sizeof(header_len) - header_len;
+
+  nlohmann::json metadata;
+  try {
+    metadata = nlohmann::json::parse(header);
+  } catch (const nlohmann::json::parse_error &e) {
+    std::cerr << "Error parsing JSON metadata in " << path << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  try {
+    for (const auto &[name, info] : metadata.items()) {
+      if (name == "__metadata__") {
+        continue;
+      }
+      TensorEntry entry;
+      entry.name = name;
+      entry.shard = shard;
+      entry.dtype = parse_dtype(info.at("dtype").get<std::string>());
+      entry.shape = info.at("shape").get<std::vector<int64_t>>();
+      std::vector<uint64_t> offsets =
+          info.at("data_offsets").get<std::vector<uint64_t>>();
+      if (entry.dtype == DTYPE_COUNT) {
+        std::cerr << "Error: Tensor " << name << " in " << path
+                  << " has unknown dtype " << info["dtype"] << std::endl;
+        return false;
+      }
+      if (offsets.size() != 2 || offsets[0] > offsets[1] ||
+          offsets[1] > data_size ||
+          offsets[1] - offsets[0] !=
+              entry.elements() * dtype_sizes[entry.dtype]) {
+        std::cerr << "Error: Tensor " << name << " in " << path
+                  << " has invalid data_offsets." << std::endl;
+        return false;
+      }
+      entry.begin = offsets[0];
+      entry.end = offsets[1];
+      entries.push_back(std::move(entry));
+    }
+  } catch (const nlohmann::json::exception &e) {
+    std::cerr << "Error: Invalid tensor metadata in " << path << ": "
+              << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Output dtype and slot of every entry. FP8 with a scale tensor and 2D F32
+// become BF16, everything else is copied as it is. With shard_size a new
+// output shard starts when the next tensor doesn't fit, a single tensor
+// bigger than shard_size gets a shard of its own.
+inline void layoutCatalog(TensorCatalog &catalog, uint64_t shard_size) {
+  uint64_t current_offset = 0;
+  catalog.out_sizes.assign(1, 0);
+  for (TensorEntry &entry : catalog.entries) {
+    entry.scale = catalog.find(entry.name + "_scale_inv");
+    entry.out_dtype = entry.dtype;
+    if (entry.dtype == DTYPE_F8_E4M3 || entry.dtype == DTYPE_F32) {
+      if (entry.shape.size() != 2) {
+        std::cerr << "Error: Tensor " << entry.name << " has shape of size "
+                  << entry.shape.size()
+                  << ", which is not 2. Skipping for BF16 conversion."
+                  << std::endl;
+      } else if (entry.dtype == DTYPE_F8_E4M3 && entry.scale == -1) {
+        std::cerr << "Warning: FP8 tensor " << entry.name
+                  << " has no scale_inv, copied as it is." << std::endl;
+      } else {
+        entry.out_dtype = DTYPE_BF16;
+      }
+    }
+    uint64_t out_bytes = entry.elements() * dtype_sizes[entry.out_dtype];
+    if (shard_size > 0 && current_offset > 0 &&
+        current_offset + out_bytes > shard_size) {
+      catalog.out_sizes.push_back(0);
+      current_offset = 0;
+    }
+    entry.out_shard = catalog.out_sizes.size() - 1;
+    entry.out_begin = current_offset;
+    entry.out_end = current_offset + out_bytes;
+    current_offset = entry.out_end;
+    catalog.out_sizes.back() = current_offset;
+  }
+}
+
+// Builds the catalog of every tensor the index maps to a shard. Shards are
+// parsed by up to thread_count threads, entries end up sorted by name, the
+// order tensors are laid out in the output (shard_size 0 for a single file).
+inline bool buildCatalog(const std::string &model_path, int thread_count,
+                         uint64_t shard_size, TensorCatalog &catalog) {
+  std::string model_index_file = model_path + "/model.safetensors.index.json";
+  std::ifstream f(model_index_file);
+  if (!f.is_open()) {
+    std::cerr << "Error: Could not open " << model_index_file << std::endl;
+    return false;
+  }
+  std::map<std::string, std::string> weight_map;
+  try {
+    nlohmann::json model_index;
+    f >> model_index;
+    weight_map =
+        model_index.at("weight_map").get<std::map<std::string, std::string>>();
+  } catch (const nlohmann::json::exception &e) {
+    std::cerr << "Error parsing " << model_index_file << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+
+  std::map<std::string, uint32_t> shard_ids;
+  for (const auto &[name, file_name] : weight_map) {
+    shard_ids.emplace(file_name, 0);
+  }
+  for (auto &[file_name, id] : shard_ids) {
+    id = catalog.shard_files.size();
+    catalog.shard_files.push_back(file_name);
+  }
+
+  size_t shard_count = catalog.shard_files.size();
+  std::vector<std::vector<TensorEntry>> shard_entries(shard_count);
+  std::atomic<size_t> next_shard(0);
+  std::atomic<bool> failed(false);
+  auto parser = [&]() {
+    for (size_t i; (i = next_shard++) < shard_count;) {
+      if (!parseShardHeader(model_path + "/" + catalog.shard_files[i], i,
+                            shard_entries[i])) {
+        failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> parsers;
+  for (size_t i = 0; i < std::min<size_t>(thread_count, shard_count); i++) {
+    parsers.emplace_back(parser);
+  }
+  for (auto &t : parsers) {
+    t.join();
+  }
+  if (failed) {
+    return false;
+  }
+
+  // a tensor only counts in the shard the index puts it in
+  for (auto &entries : shard_entries) {
+    for (TensorEntry &entry : entries) {
+      auto mapped = weight_map.find(entry.name);
+      if (mapped != weight_map.end() &&
+          shard_ids[mapped->second] == entry.shard) {
+        catalog.entries.push_back(std::move(entry));
+      }
+    }
+  }
+  if (catalog.entries.size() != weight_map.size()) {
+    std::cerr << "Warning: "
+              << weight_map.size() - catalog.entries.size()
+              << " tensors of the index are missing from their shard."
+              << std::endl;
+  }
+  std::sort(catalog.entries.begin(), catalog.entries.end(),
+            [](const TensorEntry &a, const TensorEntry &b) {
+              return a.name < b.name;
+            });
+  catalog.index();
+  layoutCatalog(catalog, shard_size);
+  return true;
+}
+
+// Header of one output shard, the only place the catalog turns into json
+inline nlohmann::json catalogMetadata(const TensorCatalog &catalog,
+                                      uint32_t out_shard) {
+  nlohmann::json metadata;
+  metadata["__metadata__"] = {{"format", "pt"}};
+  for (const TensorEntry &entry : catalog.entries) {
+    if (entry.out_shard != out_shard) {
+      continue;
+    }
+    metadata[entry.name] = {
+        {"dtype", dtype_names[entry.out_dtype]},
+        {"shape", entry.shape},
+        {"data_offsets", {entry.out_begin, entry.out_end}}};
+  }
+  return metadata;
+}
+
+#endif